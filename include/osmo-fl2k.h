@@ -28,6 +28,7 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
 #include <osmo-fl2k_export.h>
 #include <soxr.h>
 
@@ -40,6 +41,15 @@ enum fl2k_error {
 	FL2K_ERROR_BUSY = -6,
 	FL2K_ERROR_TIMEOUT = -7,
 	FL2K_ERROR_NO_MEM = -11,
+	FL2K_ERROR_NOT_SUPPORTED = -12,
+};
+
+enum fl2k_sample_format {
+	FL2K_SAMPLE_DEFAULT = 0,	/* 8 bit, sign given by sampletype_signed_x */
+	FL2K_SAMPLE_S8,			/* signed 8 bit */
+	FL2K_SAMPLE_U8,			/* unsigned 8 bit */
+	FL2K_SAMPLE_S16,		/* signed 16 bit, host byte order */
+	FL2K_SAMPLE_F32,		/* 32 bit float, -1.0 to 1.0 */
 };
 
 typedef struct fl2k_data_info {
@@ -72,9 +82,42 @@ typedef struct fl2k_data_info {
 	uint32_t r_rate;			/* sample rate of input red */
 	uint32_t g_rate;			/* sample rate of input green */
 	uint32_t b_rate;			/* sample rate of input blue */
-	
+
+	/* optional, filled in by application: formats other than 8 bit.
+	 * r_buf, g_buf and b_buf then point to FL2K_BUF_LEN samples of
+	 * the given format, the library converts them to 8 bit while
+	 * interleaving */
+	int r_format;			/* sample format of r_buf */
+	int g_format;			/* sample format of g_buf */
+	int b_format;			/* sample format of b_buf */
+	void *rgb_buf;			/* packed R, G, B triplets, replaces r/g/b_buf */
+	int rgb_format;			/* sample format of rgb_buf */
+	int dither;			/* add TPDF dither when reducing S16/F32 */
+
+	/* information provided by library */
+	int drained;			/* last sample sent after fl2k_drain_tx() */
+
+	/* optional, filled in by application: generation of the channel
+	 * content. If not 0 and equal to the generation of the content
+	 * that a transfer buffer already holds, the channel isn't
+	 * rewritten. Change it whenever the content changes. */
+	uint32_t r_gen;
+	uint32_t g_gen;
+	uint32_t b_gen;
+
+	/* information provided by library, valid if version is at least
+	 * FL2K_DATA_INFO_VERSION. Fields are only ever appended, check
+	 * version before using fields added later. */
+	uint32_t version;		/* version of this structure */
+	uint64_t seq;			/* sequence number of the buffer */
+	uint64_t sample_index;		/* index of the first sample in the stream */
+	uint64_t host_time_ns;		/* monotonic clock at the callback */
+	uint64_t emit_time_ns;		/* predicted output time of first sample,
+					 * same clock as host_time_ns */
 } fl2k_data_info_t;
 
+#define FL2K_DATA_INFO_VERSION	1
+
 typedef struct fl2k_dev fl2k_dev_t;
 
 /** The transfer length was chosen by the following criteria:
@@ -92,8 +135,81 @@ FL2K_API uint32_t fl2k_get_device_count(void);
 
 FL2K_API const char* fl2k_get_device_name(uint32_t index);
 
+/*!
+ * Get the USB port path of a device, e.g. "1-2.3" for port 3 of a hub
+ * on port 2 of bus 1. Unlike the index, the path stays the same when
+ * other devices are plugged in or removed.
+ *
+ * \param index the device index
+ * \param path buffer for the path, 32 bytes are sufficient
+ * \param len size of the buffer
+ * \return 0 on success, FL2K_ERROR_NOT_FOUND if there is no such device
+ */
+FL2K_API int fl2k_get_device_path(uint32_t index, char *path, size_t len);
+
+/*!
+ * Get the device index for a given USB port path.
+ *
+ * \param path the port path as returned by fl2k_get_device_path()
+ * \return device index on success, FL2K_ERROR_INVALID_PARAM if path is NULL,
+ * FL2K_ERROR_NO_DEVICE if no devices were found at all,
+ * FL2K_ERROR_NOT_FOUND if none of the devices is at the given path
+ */
+FL2K_API int fl2k_get_index_by_path(const char *path);
+
+/*!
+ * Get the device index for a given serial number. The serial numbers
+ * are read once and cached, which requires access to the devices.
+ *
+ * \param serial the serial number string descriptor of the device
+ * \return device index on success, FL2K_ERROR_INVALID_PARAM if serial is
+ * NULL, FL2K_ERROR_NO_DEVICE if no devices were found at all,
+ * FL2K_ERROR_NOT_FOUND if none of the devices has the given serial
+ */
+FL2K_API int fl2k_get_index_by_serial(const char *serial);
+
+typedef void(*fl2k_hotplug_cb_t)(int arrived, const char *path, void *ctx);
+
+/*!
+ * Get notified when an FL2000 device is plugged in or removed. The
+ * callback is called with the port path of the device from the hotplug
+ * thread of the library, never from the threads of a transmitting device,
+ * and may be delayed by up to 100 ms. Device indices may change after an
+ * event, so devices should be opened by path or serial. The callback may
+ * look up, open and close devices, but must not call
+ * fl2k_set_hotplug_callback().
+ *
+ * \param cb callback function, NULL to stop the notifications
+ * \param ctx user specific context to pass via the callback function
+ * \return 0 on success, FL2K_ERROR_NOT_SUPPORTED if libusb has no hotplug
+ * support on this platform
+ */
+FL2K_API int fl2k_set_hotplug_callback(fl2k_hotplug_cb_t cb, void *ctx);
+
 FL2K_API int fl2k_open(fl2k_dev_t **dev, uint32_t index);
 
+/*!
+ * Open the device at a given USB port path. Unlike looking up the index
+ * first, this can't open another device if one is plugged in or removed
+ * in between.
+ *
+ * \param dev pointer to the device handle
+ * \param path the port path as returned by fl2k_get_device_path()
+ * \return 0 on success, FL2K_ERROR_NO_DEVICE if no devices were found at
+ * all, FL2K_ERROR_NOT_FOUND if none of the devices is at the given path
+ */
+FL2K_API int fl2k_open_by_path(fl2k_dev_t **dev, const char *path);
+
+/*!
+ * Open the device with a given serial number, see fl2k_open_by_path().
+ *
+ * \param dev pointer to the device handle
+ * \param serial the serial number string descriptor of the device
+ * \return 0 on success, FL2K_ERROR_NO_DEVICE if no devices were found at
+ * all, FL2K_ERROR_NOT_FOUND if none of the devices has the given serial
+ */
+FL2K_API int fl2k_open_by_serial(fl2k_dev_t **dev, const char *serial);
+
 FL2K_API int fl2k_close(fl2k_dev_t *dev);
 
 /* configuration functions */
@@ -108,6 +224,22 @@ FL2K_API int fl2k_close(fl2k_dev_t *dev);
  */
 FL2K_API int fl2k_set_sample_rate(fl2k_dev_t *dev, uint32_t target_freq);
 
+/*!
+ * Change the sample rate while transmitting, starting with a given buffer.
+ * The PLL setting is computed in advance, and the register is written by
+ * an asynchronous control transfer as soon as the preceding buffer has
+ * been sent. If not transmitting, the rate is set immediately.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param target_freq the sample rate to be set
+ * \param seq sequence number of the first buffer with the new rate,
+ *	  buffers are counted from 0 in the order of the callbacks since
+ *	  fl2k_start_tx(). Changes must be queued in ascending order.
+ * \return 0 on success, FL2K_ERROR_BUSY if too many changes are queued
+ */
+FL2K_API int fl2k_queue_sample_rate(fl2k_dev_t *dev, uint32_t target_freq,
+				    uint64_t seq);
+
 /*!
  * Get actual sample rate the device is configured to.
  *
@@ -133,6 +265,96 @@ typedef void(*fl2k_tx_cb_t)(fl2k_data_info_t *data_info);
 FL2K_API int fl2k_start_tx(fl2k_dev_t *dev, fl2k_tx_cb_t cb,
 		     void *ctx, uint32_t buf_num);
 
+#define FL2K_MAX_PRODUCERS	8
+
+/*!
+ * Starts the tx threads like fl2k_start_tx(), but with a pool of threads
+ * calling the callback concurrently. Every call gets a transfer of its
+ * own, given by the seq and sample_index fields of data_info, and the
+ * calls may finish in any order. The transfers are still submitted
+ * strictly in the order of seq, so the callback has to be thread safe
+ * and produce exactly the samples of the seq it was called for.
+ * After fl2k_drain_tx(), the transfers of all callbacks in progress are
+ * sent.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param ctx user specific context to pass via the callback function
+ * \param buf_num optional buffer count, see fl2k_start_tx()
+ * \param threads number of threads calling back, 1 to FL2K_MAX_PRODUCERS
+ * \return 0 on success
+ */
+FL2K_API int fl2k_start_tx_parallel(fl2k_dev_t *dev, fl2k_tx_cb_t cb,
+				    void *ctx, uint32_t buf_num,
+				    uint32_t threads);
+
+/*!
+ * Fill all transfers with samples from the callback before submitting the
+ * first one, so the transmission starts with the first buffer of the
+ * application instead of zeroed buffers. Takes effect on the next call
+ * of fl2k_start_tx(), which blocks until the transfers are filled.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param timeout_ms maximum time to wait for the transfers to be filled,
+ *	  after which the remaining transfers are sent zeroed first,
+ *	  0 to disable prefilling (default)
+ * \return 0 on success
+ */
+FL2K_API int fl2k_set_prefill(fl2k_dev_t *dev, uint32_t timeout_ms);
+
+typedef void(*fl2k_watermark_cb_t)(uint32_t depth, int low, void *ctx);
+
+/*!
+ * Get a warning before an underflow happens. Whenever a transfer has
+ * been sent, the number of filled transfers waiting for submission is
+ * compared to the given level. The callback is called once when it
+ * drops below the level (low = 1) and once when it is back at the level
+ * (low = 0), e.g. to lower the processing effort in the meantime.
+ * The callback runs in the USB thread and must return quickly.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param level number of filled transfers, 0 to disable. Right after a
+ *	  submission at most 1 transfer is filled with fl2k_start_tx(), and
+ *	  at most threads with fl2k_start_tx_parallel(), so 1 warns when
+ *	  the next transfer would underflow
+ * \param cb callback function, called with the current number of filled
+ *	  transfers
+ * \param ctx user specific context to pass via the callback function
+ * \return 0 on success
+ */
+FL2K_API int fl2k_set_low_watermark(fl2k_dev_t *dev, uint32_t level,
+				    fl2k_watermark_cb_t cb, void *ctx);
+
+/*!
+ * Pause the transmission at the next buffer boundary. The transfers keep
+ * cycling with a zeroed buffer, so the device does not underrun, and the
+ * callback is not called until fl2k_resume().
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \return 0 on success
+ */
+FL2K_API int fl2k_pause(fl2k_dev_t *dev);
+
+/*!
+ * Resume a paused transmission at the next buffer boundary, starting with
+ * the buffers that were already filled when pausing.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \return 0 on success
+ */
+FL2K_API int fl2k_resume(fl2k_dev_t *dev);
+
+/*!
+ * Finish the transmission after the buffer of the current callback.
+ * The callback is not called for further samples, but all buffers
+ * already filled are sent. Once the last sample has been sent, the
+ * device is stopped and the callback is called once more with the
+ * drained flag of data_info set.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \return 0 on success
+ */
+FL2K_API int fl2k_drain_tx(fl2k_dev_t *dev);
+
 /*!
  * Cancel all pending asynchronous operations on the device.
  *
@@ -175,6 +397,298 @@ FL2K_API int fl2k_i2c_read(fl2k_dev_t *dev, uint8_t i2c_addr,
 FL2K_API int fl2k_i2c_write(fl2k_dev_t *dev, uint8_t i2c_addr,
 			    uint8_t reg_addr, uint8_t *data);
 
+/*!
+ * Read a block of bytes via the FL2K I2C bus, e.g. a 256 byte EDID.
+ * The block is read in 4 byte operations as described for fl2k_i2c_read(),
+ * completion is polled without sleeping. May be called while transmitting.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param i2c_addr address of the I2C device
+ * \param reg_addr start address of the bytes to be read
+ * \param data pointer to byte array of size len
+ * \param len number of bytes to read
+ * \return 0 on success, FL2K_ERROR_INVALID_PARAM if the block, with len
+ *         rounded up to a multiple of 4, ends after register 0xff
+ */
+FL2K_API int fl2k_i2c_read_block(fl2k_dev_t *dev, uint8_t i2c_addr,
+				 uint8_t reg_addr, uint8_t *data, uint32_t len);
+
+/*!
+ * Write a block of bytes via the FL2K I2C bus.
+ * The block is written in 4 byte operations as described for
+ * fl2k_i2c_write(). May be called while transmitting.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param i2c_addr address of the I2C device
+ * \param reg_addr start address of the bytes to be written
+ * \param data pointer to byte array of size len
+ * \param len number of bytes to write
+ * \return 0 on success, FL2K_ERROR_INVALID_PARAM if the block, with len
+ *         rounded up to a multiple of 4, ends after register 0xff
+ * \note If len is not a multiple of 4, the last operation reads the
+ *       following registers first and writes back their current contents.
+ */
+FL2K_API int fl2k_i2c_write_block(fl2k_dev_t *dev, uint8_t i2c_addr,
+				  uint8_t reg_addr, const uint8_t *data,
+				  uint32_t len);
+
+/* tracing functions */
+
+/*!
+ * Enable the event trace of the transmit pipeline. Every library thread
+ * records callback, conversion, transfer submission and completion,
+ * underflow and wait events into a ring buffer of its own.
+ * Tracing can also be enabled by setting the environment variable
+ * FL2K_TRACE to the output filename before opening the device, the
+ * trace is then written when the device is closed.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param events number of events kept per thread, 0 disables tracing
+ * \param path filename used by fl2k_trace_request_dump(), may be NULL
+ * \return 0 on success, FL2K_ERROR_BUSY while streaming
+ */
+FL2K_API int fl2k_trace_enable(fl2k_dev_t *dev, uint32_t events,
+			       const char *path);
+
+/*!
+ * Write the recorded events in the Chrome trace event format (JSON),
+ * which can be opened with chrome://tracing or the Perfetto UI.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param path output filename
+ * \return 0 on success
+ */
+FL2K_API int fl2k_trace_dump(fl2k_dev_t *dev, const char *path);
+
+/*!
+ * Request the trace to be written to the filename given to
+ * fl2k_trace_enable(). The file is written by a background thread,
+ * this function only sets a flag and may be called from a signal handler.
+ *
+ * \param dev the device handle given by fl2k_open()
+ */
+FL2K_API void fl2k_trace_request_dump(fl2k_dev_t *dev);
+
+/* monitoring functions */
+
+/*!
+ * Publish Prometheus style metrics of the device: configured and measured
+ * sample rate, underflows, queue depth, callback latency histogram,
+ * zero-copy status and device lost events. The metrics are rendered by
+ * a thread of their own, which never blocks the TX threads.
+ * Metrics can also be enabled by setting the environment variable
+ * FL2K_METRICS to the path before opening the device.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param path file that is atomically replaced every interval, or
+ *	  "unix:/path/to/socket" to answer every connection to a
+ *	  Unix domain socket with a HTTP/1.0 response
+ * \param interval_ms update interval for files, 0 for default (1 s)
+ * \return 0 on success
+ */
+FL2K_API int fl2k_metrics_start(fl2k_dev_t *dev, const char *path,
+				uint32_t interval_ms);
+
+/*!
+ * Stop publishing metrics, called by fl2k_close() as well.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \return 0 on success
+ */
+FL2K_API int fl2k_metrics_stop(fl2k_dev_t *dev);
+
+/*!
+ * Publish the spectrum of the transmitted samples. Every interval, the
+ * next converted transfer is sampled by the TX threads if they can do
+ * so without waiting, otherwise the snapshot is dropped. A thread at
+ * idle priority computes a Hann windowed FFT of every channel and
+ * publishes the magnitudes in dBFS and the number of clipped samples as
+ * JSON. Can also be enabled by setting the environment variable
+ * FL2K_SPECTRUM to the path before opening the device.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \param path file or "unix:/path/to/socket", see fl2k_metrics_start()
+ * \param fft_len FFT length, power of two from 64 to 65536, 0 for
+ *	  default (1024)
+ * \param interval_ms snapshot interval, 0 for default (1 s)
+ * \return 0 on success
+ */
+FL2K_API int fl2k_spectrum_start(fl2k_dev_t *dev, const char *path,
+				 uint32_t fft_len, uint32_t interval_ms);
+
+/*!
+ * Stop the spectrum monitor, called by fl2k_close() as well.
+ *
+ * \param dev the device handle given by fl2k_open()
+ * \return 0 on success, FL2K_ERROR_BUSY while streaming
+ */
+FL2K_API int fl2k_spectrum_stop(fl2k_dev_t *dev);
+
+/* per-channel sample queues */
+
+typedef struct fl2k_queue fl2k_queue_t;
+
+/*!
+ * Create a queue of sample buffers for a single channel. Every channel
+ * can be fed by a producer thread of its own, which may run ahead of the
+ * others by up to the number of slots. Used together with
+ * fl2k_queue_fill() in the callback.
+ *
+ * \param q pointer to the queue handle
+ * \param slots number of slots (2 to 64), each holding FL2K_BUF_LEN samples
+ * \param format sample format of the slots, see enum fl2k_sample_format,
+ *	  FL2K_SAMPLE_DEFAULT is not allowed
+ * \return 0 on success
+ */
+FL2K_API int fl2k_queue_create(fl2k_queue_t **q, uint32_t slots, int format);
+
+/*!
+ * Get the next free slot for writing (producer side), waiting while all
+ * slots are in use.
+ *
+ * \param q the queue handle given by fl2k_queue_create()
+ * \param timeout_ms maximum time to wait for a free slot, -1 for infinite
+ * \return pointer to the slot, NULL on timeout
+ */
+FL2K_API void *fl2k_queue_acquire(fl2k_queue_t *q, int timeout_ms);
+
+/*!
+ * Pass the slot given by fl2k_queue_acquire() to the transmitter.
+ *
+ * \param q the queue handle given by fl2k_queue_create()
+ * \return 0 on success
+ */
+FL2K_API int fl2k_queue_commit(fl2k_queue_t *q);
+
+/*!
+ * Hand the next committed slot of every given channel to the library, to
+ * be called from the callback. The slots of the previous call are
+ * released, so this only works with fl2k_start_tx(). If one of the
+ * channels has no slot in time, none is taken, so the channels stay
+ * aligned.
+ *
+ * \param r queue of the red channel, may be NULL
+ * \param g queue of the green channel, may be NULL
+ * \param b queue of the blue channel, may be NULL
+ * \param data_info data_info of the callback
+ * \param timeout_ms maximum time to wait for the slots, -1 for infinite
+ * \return 0 on success, FL2K_ERROR_TIMEOUT on underflow, data_info is
+ *	   left unchanged then and zeros are sent
+ */
+FL2K_API int fl2k_queue_fill(fl2k_queue_t *r, fl2k_queue_t *g,
+			     fl2k_queue_t *b, fl2k_data_info_t *data_info,
+			     int timeout_ms);
+
+/*!
+ * Get the number of committed slots and the number of underflows, i.e.
+ * callbacks that found no committed slot in this queue.
+ *
+ * \param q the queue handle
+ * \param queued number of committed slots, may be NULL
+ * \param underflows number of underflows, may be NULL
+ * \return 0 on success
+ */
+FL2K_API int fl2k_queue_get_info(fl2k_queue_t *q, uint32_t *queued,
+				 uint64_t *underflows);
+
+/*!
+ * Free the queue, after the transmission has been stopped and the
+ * producers are done with it.
+ *
+ * \param q the queue handle
+ */
+FL2K_API void fl2k_queue_destroy(fl2k_queue_t *q);
+
+/* shared memory ring, Linux only */
+
+typedef struct fl2k_shm fl2k_shm_t;
+
+enum fl2k_shm_layout {
+	FL2K_SHM_PLANAR = 0,		/* R, G and B planes of FL2K_BUF_LEN samples */
+	FL2K_SHM_PACKED,		/* FL2K_BUF_LEN R, G, B triplets */
+};
+
+/*!
+ * Create a ring of shared memory slots that other processes can write
+ * samples into, and listen for them on a Unix domain socket.
+ * Used by the transmitting process together with fl2k_shm_fill().
+ *
+ * \param shm pointer to the ring handle
+ * \param path path of the Unix domain socket
+ * \param slots number of slots (2 to 64), each holding FL2K_BUF_LEN samples
+ *	  of all three channels
+ * \param format sample format of the slots, see enum fl2k_sample_format,
+ *	  FL2K_SAMPLE_DEFAULT is not allowed
+ * \return 0 on success
+ */
+FL2K_API int fl2k_shm_create(fl2k_shm_t **shm, const char *path,
+			     uint32_t slots, int format);
+
+/*!
+ * Hand the next committed slot to the library, to be called from the
+ * callback. The slot of the previous call is released, so this only
+ * works with fl2k_start_tx(), not with several threads calling back.
+ * Connections of producers are answered here as well.
+ *
+ * \param shm the ring handle given by fl2k_shm_create()
+ * \param data_info data_info of the callback
+ * \param timeout_ms maximum time to wait for a slot
+ * \return 0 on success, FL2K_ERROR_TIMEOUT on underflow, data_info is
+ *	   left unchanged then and zeros are sent
+ */
+FL2K_API int fl2k_shm_fill(fl2k_shm_t *shm, fl2k_data_info_t *data_info,
+			   int timeout_ms);
+
+/*!
+ * Connect to the ring of a transmitting process (producer side).
+ * Blocks until the transmitter answers with its next callback.
+ * The ring has a single producer: while one is connected, i.e. until it
+ * calls fl2k_shm_destroy() or exits, other connections are refused.
+ *
+ * \param shm pointer to the ring handle
+ * \param path path of the Unix domain socket given to fl2k_shm_create()
+ * \return 0 on success, FL2K_ERROR_BUSY if another producer is connected
+ */
+FL2K_API int fl2k_shm_connect(fl2k_shm_t **shm, const char *path);
+
+/*!
+ * Get the next free slot for writing, waiting while all slots are in use.
+ *
+ * \param shm the ring handle given by fl2k_shm_connect()
+ * \param timeout_ms maximum time to wait for a free slot, -1 for infinite
+ * \return pointer to the slot, NULL on timeout
+ */
+FL2K_API void *fl2k_shm_acquire(fl2k_shm_t *shm, int timeout_ms);
+
+/*!
+ * Pass the slot given by fl2k_shm_acquire() to the transmitter.
+ *
+ * \param shm the ring handle given by fl2k_shm_connect()
+ * \param layout layout of the samples in the slot, see enum fl2k_shm_layout
+ * \return 0 on success
+ */
+FL2K_API int fl2k_shm_commit(fl2k_shm_t *shm, int layout);
+
+/*!
+ * Get the parameters of the ring and the number of underflows, i.e.
+ * callbacks of the transmitter that found no committed slot.
+ *
+ * \param shm the ring handle
+ * \param format sample format of the slots, may be NULL
+ * \param slots number of slots, may be NULL
+ * \param underflows number of underflows, may be NULL
+ * \return 0 on success
+ */
+FL2K_API int fl2k_shm_get_info(fl2k_shm_t *shm, int *format, uint32_t *slots,
+			       uint64_t *underflows);
+
+/*!
+ * Unmap the ring and close it, for both producers and the transmitter.
+ *
+ * \param shm the ring handle
+ */
+FL2K_API void fl2k_shm_destroy(fl2k_shm_t *shm);
+
 #ifdef __cplusplus
 }
 #endif
@@ -20,6 +20,10 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE	/* pthread_setaffinity_np() */
+#endif
+
 #include <errno.h>
 #include <signal.h>
 #include <string.h>
@@ -32,6 +36,9 @@
 
 #ifndef _WIN32
 	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
 	#define sleep_ms(ms)	usleep(ms*1000)
 	#else
 	#include <windows.h>
@@ -82,11 +89,6 @@ char *inbuf_r = NULL;
 char *inbuf_g = NULL;
 char *inbuf_b = NULL;
 
-//resample buffer
-short *resbuf_r = NULL;
-short *resbuf_g = NULL;
-short *resbuf_b = NULL;
-
 //output buffer
 char *outbuf_r = NULL;
 char *outbuf_g = NULL;
@@ -181,21 +183,57 @@ uint32_t field_cnt_b = 0;//used for tbc processing
 
 //unsigned char *pipe_buf = NULL;
 
+//long-lived worker thread, runs its job once per callback
+typedef struct channel_worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	void (*job)(void *arg);
+	void *arg;
+	int cpu;//-1 = not pinned
+	unsigned long posted;
+	unsigned long done;
+	int running;
+	int stop;
+} channel_worker;
+
 //thread for processing
-pthread_t thread_r;
-pthread_t thread_g;
-pthread_t thread_b;
+channel_worker thread_r;
+channel_worker thread_g;
+channel_worker thread_b;
 
 //thread for resampling
-pthread_t thread_r_res;
-pthread_t thread_g_res;
-pthread_t thread_b_res;
+channel_worker thread_r_res;
+channel_worker thread_g_res;
+channel_worker thread_b_res;
+
+//cpu pinning of the channel workers (-1 = not pinned)
+int cpu_r = -1;
+int cpu_g = -1;
+int cpu_b = -1;
+
+//number of 16 bit buffers handed between the reader and the resampler
+#define RESAMPLE_POOL_LEN 2
+
+//bounded queue of buffer handles
+typedef struct handle_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	short *buf[RESAMPLE_POOL_LEN];
+	unsigned int head;
+	unsigned int count;
+} handle_queue;
 
 typedef struct soxr_resample_data {//used with soxr and pthread
 	soxr_t soxr;
 	fl2k_data_info_t *data_info;
-	int *state_resample;
-	int *state_process;
+	short *input;//buffer read by soxr_input_fn
+	short *obuf;//16 bit output of soxr
+	handle_queue filled;//processed by the reader, waiting for the resampler
+	handle_queue empty;//given back by the resampler
+	unsigned long pushed;//buffers pushed to filled by the reader
+	unsigned long consumed;//buffers popped from filled by the resampler
+	unsigned long ready;//buffers of earlier callbacks, set before the resampler runs
 	char color;
 } resample_data;
 
@@ -203,24 +241,113 @@ resample_data soxr_data_r;
 resample_data soxr_data_g;
 resample_data soxr_data_b;
 
-//process synchronisation
-//0 = initialisation | 1 = ready | 2 = processing | 3 = finished
-int resample_r_state = 0;
-int resample_g_state = 0;
-int resample_b_state = 0;
-
-int process_r_state = 0;
-int process_g_state = 0;
-int process_b_state = 0;
-
-//pointer to variable
-int *resample_r_state_ptr = &resample_r_state;
-int *resample_g_state_ptr = &resample_g_state;
-int *resample_b_state_ptr = &resample_b_state;
-
-int *process_r_state_ptr = &process_r_state;
-int *process_g_state_ptr = &process_g_state;
-int *process_b_state_ptr = &process_b_state;
+//buffers are cache line aligned, arenas of 2MB and more huge page aligned
+#define ARENA_ALIGN		64
+#define ARENA_HUGE_ALIGN	(2 * 1024 * 1024)
+
+//largest audio frame (PAL)
+#define AUDIO_FRAME_MAX	((88200/25) * 2)
+
+//working buffers of one channel, allocated once at startup
+typedef struct channel_arena {
+	void *mem;
+	size_t len;
+	int locked;
+	size_t read_len;//size of calc and calc2
+	unsigned char *tmp_buf;
+	unsigned char *audio_buf;
+	unsigned char *calc;
+	unsigned char *calc2;
+	short *res[RESAMPLE_POOL_LEN];
+	short *obuf;
+} channel_arena;
+
+channel_arena arena_r;
+channel_arena arena_g;
+channel_arena arena_b;
+
+//lock the arenas in memory
+int lock_mem = 0;
+
+//how far ahead of the reader the kernel is asked to read a mapped file
+#define MAP_READAHEAD	(32 * 1024 * 1024)
+
+//regular input file read through a memory mapping
+typedef struct mapped_input {
+	unsigned char *base;//NULL = read with fread()
+	uint64_t len;
+	uint64_t pos;
+	uint64_t advised;//end of the readahead window
+	uint64_t released;//start of the pages still mapped in
+	uint64_t page;
+	int eof;
+	char *direct;//handed to the library as is, NULL = processed into outbuf
+	int direct_signed;
+} mapped_input;
+
+mapped_input map_r;
+mapped_input map_g;
+mapped_input map_b;
+mapped_input map2_r;
+mapped_input map2_g;
+mapped_input map2_b;
+
+//input read ahead into RAM by a reader thread (-bufHigh), 0 = disabled
+double buf_high = 0;
+double buf_low = 0;
+int use_direct_io = 0;
+
+//reads are aligned as required by O_DIRECT
+#define PREBUF_ALIGN	4096
+#define PREBUF_CHUNK	(1024 * 1024)
+
+//one thread serves all inputs in turn, reading this much content of each
+//file per turn so a disk seeks between files as rarely as possible
+#define IO_SLICE_MS	500
+#define IO_BURST_MIN	(4 * 1024 * 1024)
+#define IO_BURST_MAX	(64 * 1024 * 1024)
+#define IO_MAX_INPUTS	7
+
+typedef struct prebuffer {
+	unsigned char *mem;//NULL = not used
+	size_t size;
+	size_t high;//stop reading above this level (bytes)
+	size_t low;//resume reading below this level (bytes)
+	uint64_t head;//bytes read from the file
+	uint64_t tail;//bytes handed to the processing
+	size_t discard;//bytes before the start offset (O_DIRECT alignment)
+	uint64_t offset;//file offset of the next pread()
+	int fd;
+	int own_fd;
+	int seekable;
+	int filling;
+	size_t wanted;//bytes a blocked read waits for, 0 = none
+	int eof;
+	int drained;
+	unsigned long underflows;
+	double rate;//consumption in bytes per second
+	uint64_t rate_tail;
+	uint64_t rate_ns;
+} prebuffer;
+
+//all prebuffers share the lock of the scheduler
+struct io_scheduler {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int running;
+	int stop;
+	prebuffer *pb[IO_MAX_INPUTS];
+	int num;
+} io_sched = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+prebuffer pb_r;
+prebuffer pb_g;
+prebuffer pb_b;
+prebuffer pb2_r;
+prebuffer pb2_g;
+prebuffer pb2_b;
+prebuffer pb_audio;
 
 void usage(void)
 {
@@ -281,6 +408,13 @@ void usage(void)
 		"\t[-audioOffset offset audio from a duration of x frame\n"
 		"\t[-pipeMode (default = A) option : A = Audio file / R = output of R / G = output of G / B = output of B\n"
 		"\t[-readMode (default = 0) option : 0 = multit-threading (RGB) / 1 = hybrid (R --> GB) / 2 = hybrid (RG --> B) / 3 = sequential (R -> G -> B)\n"
+		"\t[-cpuR pin the R worker threads to a cpu\n"
+		"\t[-cpuG pin the G worker threads to a cpu\n"
+		"\t[-cpuB pin the B worker threads to a cpu\n"
+		"\t[-lockMem lock the processing buffers in memory\n"
+		"\t[-bufHigh read the inputs ahead up to x seconds in a reader thread\n"
+		"\t[-bufLow resume reading ahead below x seconds (default : half of bufHigh)\n"
+		"\t[-directIO read the inputs with O_DIRECT (with bufHigh)\n"
 		"\n-info-version------------------------------------------------------\n\n"
 		"runtime=%s API="SOXR_THIS_VERSION_STR"\n",
 	soxr_version());
@@ -312,12 +446,654 @@ static void sighandler(int signum)
 	fl2k_stop_tx(dev);
 	do_exit = 1;
 }
+
+static void sigusr1_handler(int signum)
+{
+	fl2k_trace_request_dump(dev);
+}
+#endif
+
+void handle_queue_init(handle_queue *q)
+{
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	q->head = 0;
+	q->count = 0;
+}
+
+//blocks while the queue is full
+void handle_queue_push(handle_queue *q, short *buf)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->count == RESAMPLE_POOL_LEN)
+		pthread_cond_wait(&q->cond, &q->lock);
+
+	q->buf[(q->head + q->count) % RESAMPLE_POOL_LEN] = buf;
+	q->count++;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+//blocks while the queue is empty if wait is set, otherwise returns NULL
+short *handle_queue_pop(handle_queue *q, int wait)
+{
+	short *buf = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	while (wait && q->count == 0)
+		pthread_cond_wait(&q->cond, &q->lock);
+
+	if (q->count > 0)
+	{
+		buf = q->buf[q->head];
+		q->head = (q->head + 1) % RESAMPLE_POOL_LEN;
+		q->count--;
+		pthread_cond_broadcast(&q->cond);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return buf;
+}
+
+static size_t arena_slice(size_t len)
+{
+	return (len + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+//largest read of one buffer, including the lines skipped in tbc files
+static size_t channel_read_len(int is16, int istbc)
+{
+	size_t len = input_buf_size * (1 + is16);
+	size_t frame_lengt = 0;
+	size_t line_lengt = 0;
+
+	if(video_standard == 'P')
+	{
+		frame_lengt = 709379 * (1 + is16);
+		line_lengt = 1135 * (1 + is16);
+	}
+	else if(video_standard == 'N')
+	{
+		frame_lengt = 477750 * (1 + is16);
+		line_lengt = 910 * (1 + is16);
+	}
+
+	//calc_nb_skip() skips at most one line per started frame, plus the current one
+	if(istbc && frame_lengt)
+		len += (3 + len / frame_lengt) * line_lengt;
+
+	return len;
+}
+
+int channel_arena_init(channel_arena *a, int is16, int istbc, int is_stereo)
+{
+	size_t read_len = channel_read_len(is16, istbc);
+	size_t res_len = arena_slice(input_buf_size*2);
+	size_t len, align;
+	unsigned char *p;
+	int i;
+
+	len = arena_slice(input_buf_size) + arena_slice(AUDIO_FRAME_MAX) +
+	      arena_slice(read_len) * (1 + is_stereo);
+	if(resample)
+		len += res_len * RESAMPLE_POOL_LEN + arena_slice(2 * FL2K_BUF_LEN);
+
+	align = (len >= ARENA_HUGE_ALIGN) ? ARENA_HUGE_ALIGN : ARENA_ALIGN;
+	len = (len + align - 1) & ~(align - 1);
+
+#ifdef _WIN32
+	a->mem = _aligned_malloc(len, align);
+#else
+	if (posix_memalign(&a->mem, align, len) != 0)
+		a->mem = NULL;
+#endif
+	if (!a->mem)
+		return -1;
+
+#ifdef MADV_HUGEPAGE
+	if (align == ARENA_HUGE_ALIGN)
+		madvise(a->mem, len, MADV_HUGEPAGE);
+#endif
+	//fault the pages in now rather than while streaming
+	memset(a->mem, 0, len);
+	a->len = len;
+	a->read_len = read_len;
+
+	p = a->mem;
+	a->tmp_buf = p;
+	p += arena_slice(input_buf_size);
+	a->audio_buf = p;
+	p += arena_slice(AUDIO_FRAME_MAX);
+	a->calc = p;
+	p += arena_slice(read_len);
+	if(is_stereo)
+	{
+		a->calc2 = p;
+		p += arena_slice(read_len);
+	}
+	if(resample)
+	{
+		for (i = 0; i < RESAMPLE_POOL_LEN; i++)
+		{
+			a->res[i] = (short *)p;
+			p += res_len;
+		}
+		a->obuf = (short *)p;
+	}
+
+	if (lock_mem)
+	{
+#ifdef _WIN32
+		a->locked = VirtualLock(a->mem, len) != 0;
+#else
+		a->locked = mlock(a->mem, len) == 0;
+#endif
+		if (!a->locked)
+			fprintf(stderr, "WARNING: Failed to lock %lu bytes of buffers in memory\n", (unsigned long)len);
+	}
+
+	return 0;
+}
+
+void channel_arena_free(channel_arena *a)
+{
+	if (!a->mem)
+		return;
+
+#ifdef _WIN32
+	if (a->locked)
+		VirtualUnlock(a->mem, a->len);
+	_aligned_free(a->mem);
+#else
+	if (a->locked)
+		munlock(a->mem, a->len);
+	free(a->mem);
+#endif
+	memset(a, 0, sizeof(*a));
+}
+
+#ifndef _WIN32
+static void mapped_input_advise(mapped_input *m)
+{
+	uint64_t end;
+
+	if (m->advised >= m->len || m->advised >= m->pos + MAP_READAHEAD)
+		return;
+
+	end = m->pos + 2 * MAP_READAHEAD;
+	if (end > m->len)
+		end = m->len;
+
+	madvise(m->base + m->advised, end - m->advised, MADV_WILLNEED);
+	m->advised = end;
+}
+#endif
+
+//map a regular file, stays on fread() for pipes or if mmap fails
+int mapped_input_open(mapped_input *m, FILE *stream, uint64_t start)
+{
+#ifndef _WIN32
+	struct stat st;
+	void *base;
+
+	memset(m, 0, sizeof(*m));
+
+	if (fstat(fileno(stream), &st) < 0 || !S_ISREG(st.st_mode) ||
+	    (uint64_t)st.st_size <= start)
+		return -1;
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(stream), 0);
+	if (base == MAP_FAILED)
+		return -1;
+
+	madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+	m->base = base;
+	m->len = st.st_size;
+	m->page = sysconf(_SC_PAGESIZE);
+	m->pos = start;
+	m->released = start & ~(m->page - 1);
+	m->advised = m->released;
+	mapped_input_advise(m);
+
+	return 0;
+#else
+	memset(m, 0, sizeof(*m));
+	return -1;
+#endif
+}
+
+void mapped_input_close(mapped_input *m)
+{
+#ifndef _WIN32
+	if (m->base)
+		munmap(m->base, m->len);
+#endif
+	memset(m, 0, sizeof(*m));
+}
+
+//next len bytes of the mapping, NULL once the file is exhausted
+static unsigned char *mapped_input_read(mapped_input *m, uint64_t len)
+{
+	unsigned char *p = NULL;
+#ifndef _WIN32
+	uint64_t done;
+
+	if (m->len - m->pos < len)
+	{
+		m->pos = m->len;
+		m->eof = 1;
+		return NULL;
+	}
+
+	//the previous buffers have been sent, drop their pages
+	done = m->pos & ~(m->page - 1);
+	if (done > m->released)
+	{
+		madvise(m->base + m->released, done - m->released, MADV_DONTNEED);
+		m->released = done;
+	}
+
+	p = m->base + m->pos;
+	m->pos += len;
+	mapped_input_advise(m);
+#endif
+	return p;
+}
+
+#ifndef _WIN32
+static uint64_t io_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//bytes to read in one turn, from the measured consumption (lock held)
+static size_t prebuffer_burst(prebuffer *pb)
+{
+	uint64_t now = io_now_ns();
+	double rate;
+	size_t burst;
+
+	if (pb->rate_ns && now - pb->rate_ns >= 100000000ULL)
+	{
+		rate = (pb->tail - pb->rate_tail) * 1e9 / (now - pb->rate_ns);
+		if (rate > 0)
+			pb->rate = (pb->rate * 3 + rate) / 4;
+	}
+	if (pb->rate_ns == 0 || now - pb->rate_ns >= 100000000ULL)
+	{
+		pb->rate_tail = pb->tail;
+		pb->rate_ns = now;
+	}
+
+	burst = (size_t)(pb->rate * IO_SLICE_MS / 1000);
+	if (burst < IO_BURST_MIN)
+		burst = IO_BURST_MIN;
+	if (burst > IO_BURST_MAX)
+		burst = IO_BURST_MAX;
+
+	return burst & ~(size_t)(PREBUF_ALIGN - 1);
+}
+
+//read one burst into pb (lock held, dropped during the reads)
+static void prebuffer_fill_burst(prebuffer *pb)
+{
+	size_t todo = prebuffer_burst(pb);
+	size_t free_len, pos, len;
+	ssize_t n;
+
+	free_len = (pb->size - (pb->head - pb->tail)) & ~(size_t)(PREBUF_ALIGN - 1);
+	if (todo > free_len)
+		todo = free_len;
+
+	while (todo > 0 && !pb->eof && !io_sched.stop)
+	{
+		pos = pb->head % pb->size;
+		len = pb->size - pos;
+		if (len > todo)
+			len = todo;
+
+		//only the scheduler writes to the free part of the ring
+		pthread_mutex_unlock(&io_sched.lock);
+		if (pb->seekable)
+			n = pread(pb->fd, pb->mem + pos, len, pb->offset);
+		else
+			n = read(pb->fd, pb->mem + pos, len);
+		pthread_mutex_lock(&io_sched.lock);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+		{
+			if (n < 0)
+				fprintf(stderr, "prebuffer read error %d\n", errno);
+			pb->eof = 1;
+		}
+		else
+		{
+			pb->head += n;
+			pb->offset += n;
+			todo -= n;
+			//a short read from a pipe, come back on the next turn
+			if ((size_t)n < len && !pb->seekable)
+				todo = 0;
+		}
+		pthread_cond_broadcast(&io_sched.cond);
+	}
+}
+
+static void *io_sched_thread(void *arg)
+{
+	prebuffer *pb;
+	size_t level;
+	int i, next = 0, busy;
+
+	pthread_mutex_lock(&io_sched.lock);
+	while (!io_sched.stop)
+	{
+		busy = 0;
+
+		//one burst per input that is below its low watermark, in turn
+		for (i = 0; i < io_sched.num && !io_sched.stop; i++)
+		{
+			pb = io_sched.pb[(next + i) % io_sched.num];
+			if (pb->eof)
+				continue;
+
+			level = pb->head - pb->tail;
+			if (level >= pb->high)
+				pb->filling = 0;
+			else if (level <= pb->low || level < pb->wanted)
+				pb->filling = 1;
+
+			if (!pb->filling)
+				continue;
+
+			prebuffer_fill_burst(pb);
+			busy = 1;
+		}
+		if (io_sched.num)
+			next = (next + 1) % io_sched.num;
+
+		if (!busy && !io_sched.stop)
+			pthread_cond_wait(&io_sched.cond, &io_sched.lock);
+	}
+	pthread_mutex_unlock(&io_sched.lock);
+
+	return NULL;
+}
+#endif
+
+//read the input ahead, keeping between low and high seconds of rate bytes per
+//second buffered, reads of the processing are at most max_read bytes
+int prebuffer_open(prebuffer *pb, FILE *stream, const char *filename, uint64_t start,
+		   double rate, size_t max_read)
+{
+#ifndef _WIN32
+	struct stat st;
+	uint64_t aligned = start & ~(uint64_t)(PREBUF_ALIGN - 1);
+	size_t min_high;
+
+	memset(pb, 0, sizeof(*pb));
+
+	pthread_mutex_lock(&io_sched.lock);
+	if (io_sched.num == IO_MAX_INPUTS)
+	{
+		pthread_mutex_unlock(&io_sched.lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&io_sched.lock);
+
+	//keep at least a few reads, a read must never wait for more than high
+	min_high = 4 * max_read + PREBUF_CHUNK;
+	pb->high = (size_t)(buf_high * rate);
+	if (pb->high < min_high)
+		pb->high = min_high;
+	pb->high &= ~(size_t)(PREBUF_ALIGN - 1);
+	pb->low = (size_t)(buf_low * rate);
+	if (buf_low <= 0 || pb->low >= pb->high)
+		pb->low = pb->high / 2;
+	if (pb->low < max_read)
+		pb->low = max_read;
+	pb->rate = rate;
+	//room for a whole burst on top of the high watermark
+	pb->size = pb->high + prebuffer_burst(pb);
+
+	pb->fd = fileno(stream);
+	pb->seekable = fstat(pb->fd, &st) == 0 && S_ISREG(st.st_mode);
+#ifdef O_DIRECT
+	if (use_direct_io && pb->seekable && filename)
+	{
+		int fd = open(filename, O_RDONLY | O_DIRECT);
+
+		if (fd < 0)
+		{
+			fprintf(stderr, "WARNING: O_DIRECT not supported for %s\n", filename);
+		}
+		else
+		{
+			pb->fd = fd;
+			pb->own_fd = 1;
+		}
+	}
+#endif
+	//O_DIRECT reads start on a block boundary, skip what is before the start offset
+	if (pb->seekable)
+	{
+		pb->offset = pb->own_fd ? aligned : start;
+		pb->discard = start - pb->offset;
+	}
+
+	if (posix_memalign((void **)&pb->mem, PREBUF_ALIGN, pb->size) != 0)
+	{
+		pb->mem = NULL;
+		goto fail;
+	}
+	if (lock_mem && mlock(pb->mem, pb->size) != 0)
+		fprintf(stderr, "WARNING: Failed to lock the prebuffer in memory\n");
+
+	pb->filling = 1;
+
+	pthread_mutex_lock(&io_sched.lock);
+	if (!io_sched.running)
+	{
+		io_sched.stop = 0;
+		if (pthread_create(&io_sched.thread, NULL, io_sched_thread, NULL) != 0)
+		{
+			pthread_mutex_unlock(&io_sched.lock);
+			free(pb->mem);
+			pb->mem = NULL;
+			goto fail;
+		}
+		io_sched.running = 1;
+	}
+	io_sched.pb[io_sched.num++] = pb;
+	pthread_cond_broadcast(&io_sched.cond);
+	pthread_mutex_unlock(&io_sched.lock);
+
+	return 0;
+fail:
+	if (pb->own_fd)
+		close(pb->fd);
+	pb->own_fd = 0;
+	fprintf(stderr, "WARNING: Failed to start the prebuffer\n");
+#else
+	memset(pb, 0, sizeof(*pb));
+#endif
+	return -1;
+}
+
+//wait for the scheduler (lock held), wakes up regularly to notice do_exit,
+//which is set from the signal handler
+static void io_sched_wait(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += 100000000;
+	if (ts.tv_nsec >= 1000000000)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&io_sched.cond, &io_sched.lock, &ts);
+}
+
+//wait until the prebuffer reached its high watermark or the end of the input
+void prebuffer_fill(prebuffer *pb)
+{
+	if (!pb->mem)
+		return;
+
+	pthread_mutex_lock(&io_sched.lock);
+	while (pb->filling && !pb->eof && !do_exit)
+		io_sched_wait();
+	pthread_mutex_unlock(&io_sched.lock);
+}
+
+//copy len bytes out of the prebuffer, -1 once the input is exhausted
+static int prebuffer_read(prebuffer *pb, unsigned char *dst, size_t len)
+{
+	size_t pos, part;
+	int waited = 0;
+
+	pthread_mutex_lock(&io_sched.lock);
+	while (pb->head - pb->tail < pb->discard + len && !pb->eof && !do_exit)
+	{
+		//the ring may be above its low watermark but still hold less
+		//than this read, make the scheduler fill it anyway
+		if (!waited)
+		{
+			pb->wanted = pb->discard + len;
+			pthread_cond_broadcast(&io_sched.cond);
+		}
+		waited = 1;
+		io_sched_wait();
+	}
+	pb->wanted = 0;
+	if (waited)
+		pb->underflows++;
+
+	if (do_exit)
+	{
+		pthread_mutex_unlock(&io_sched.lock);
+		return -1;
+	}
+
+	pb->tail += pb->discard;
+	pb->discard = 0;
+
+	if (pb->head - pb->tail < len)
+	{
+		pb->tail = pb->head;
+		pb->drained = 1;
+		pthread_mutex_unlock(&io_sched.lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&io_sched.lock);
+
+	//the scheduler does not touch the filled part of the ring
+	pos = pb->tail % pb->size;
+	part = pb->size - pos;
+	if (part > len)
+		part = len;
+	memcpy(dst, pb->mem + pos, part);
+	memcpy(dst + part, pb->mem, len - part);
+
+	pthread_mutex_lock(&io_sched.lock);
+	pb->tail += len;
+	if (pb->head - pb->tail <= pb->low)
+		pthread_cond_broadcast(&io_sched.cond);
+	pthread_mutex_unlock(&io_sched.lock);
+
+	return 0;
+}
+
+//stop the scheduler, before the prebuffers are closed
+void io_sched_stop(void)
+{
+	pthread_mutex_lock(&io_sched.lock);
+	if (!io_sched.running)
+	{
+		pthread_mutex_unlock(&io_sched.lock);
+		return;
+	}
+	io_sched.stop = 1;
+	pthread_cond_broadcast(&io_sched.cond);
+	pthread_mutex_unlock(&io_sched.lock);
+
+	pthread_join(io_sched.thread, NULL);
+	io_sched.running = 0;
+	io_sched.num = 0;
+}
+
+void prebuffer_close(prebuffer *pb)
+{
+	if (!pb->mem)
+		return;
+
+	if (pb->underflows)
+		fprintf(stderr, "prebuffer ran empty %lu times\n", pb->underflows);
+
+#ifndef _WIN32
+	if (pb->own_fd)
+		close(pb->fd);
 #endif
+	free(pb->mem);
+	memset(pb, 0, sizeof(*pb));
+}
+
+//open the read path of an input file
+void input_open(FILE *stream, const char *filename, uint64_t start, int is16,
+		mapped_input *m, prebuffer *pb)
+{
+	memset(m, 0, sizeof(*m));
+	memset(pb, 0, sizeof(*pb));
+
+	if (buf_high > 0 &&
+	    prebuffer_open(pb, stream, filename, start, (double)input_sample_rate * (1 + is16),
+			   channel_read_len(is16, 1)) == 0)
+		return;
+
+	if (stream != stdin)
+		mapped_input_open(m, stream, start);
+}
+
+static int channel_eof(FILE *stream, mapped_input *m, prebuffer *pb)
+{
+	if (pb->mem)
+		return pb->drained;
+
+	return m->base ? m->eof : feof(stream);
+}
+
+//hand the resample buffers of the arena to the reader
+void resample_pool_init(resample_data *soxr_data, channel_arena *a)
+{
+	int i;
+
+	handle_queue_init(&soxr_data->filled);
+	handle_queue_init(&soxr_data->empty);
+
+	for (i = 0; i < RESAMPLE_POOL_LEN; i++)
+		handle_queue_push(&soxr_data->empty, a->res[i]);
+
+	soxr_data->pushed = 0;
+	soxr_data->consumed = 0;
+	soxr_data->ready = 0;
 
-static size_t soxr_input_fn(void * ibuf, soxr_cbuf_t * buf, size_t len)
+	soxr_data->obuf = a->obuf;
+}
+
+static size_t soxr_input_fn(void * input_state, soxr_cbuf_t * buf, size_t len)
 {
-	*buf = ibuf;
-	//memcpy(ibuf,copyinbuf);
+	resample_data *soxr_data = input_state;
+
+	*buf = soxr_data->input;
 	return len+1;//+1 to avoid looping
 }
 
@@ -335,19 +1111,19 @@ void resampler_open(fl2k_data_info_t *data_info, soxr_t *soxr, uint32_t orate0,
 	if(color == 'R')
 	{
 		irate = (float)data_info->r_rate;
-		ibuf = data_info->r_buf_res;
+		ibuf = &soxr_data_r;
 		ilen = data_info->r_buf_len;
 	}
 	if(color == 'G')
 	{
 		irate = (float)data_info->g_rate;
-		ibuf = data_info->g_buf_res;
+		ibuf = &soxr_data_g;
 		ilen = data_info->g_buf_len;
 	}
 	if(color == 'B')
 	{
 		irate = (float)data_info->b_rate;
-		ibuf = data_info->b_buf_res;
+		ibuf = &soxr_data_b;
 		ilen = data_info->b_buf_len;
 	}
 	
@@ -407,48 +1183,45 @@ void fl2k_resample_to_freq(resample_data *soxr_data)
 	
 	int resampled = 0;
 	char *buf_out;
-	short *buf_res;
-	int *process_state = soxr_data->state_process;
-	int *resample_state = soxr_data->state_resample;
 	
 	if(color == 'R')
 	{
 		resampled = data_info->r_sample_resampled;
 		buf_out = data_info->r_buf;
-		buf_res = data_info->r_buf_res;
 	}
 	if(color == 'G')
 	{
 		resampled = data_info->g_sample_resampled;
 		buf_out = data_info->g_buf;
-		buf_res = data_info->g_buf_res;
 	}
 	if(color == 'B')
 	{
 		resampled = data_info->b_sample_resampled;
 		buf_out = data_info->b_buf;
-		buf_res = data_info->b_buf_res;
 	}
 	
 	unsigned int i = 0;
 	size_t const olen = FL2K_BUF_LEN;
-	void * const obuf = malloc(2 * olen);
-	short *obuf16 = (void *)obuf;
+	short *obuf16 = soxr_data->obuf;
+	
+	//buffer processed by the reader during the previous callback, the
+	//reader of this callback runs concurrently and must not be picked up
+	short *input = NULL;
 
-	if(*resample_state != 0)//if not first call
+	if(soxr_data->ready > 0)
 	{
-		//set status to ready
-		*resample_state = 1;
-			
-		//wait fl2K_callback to be ready
-		while(*process_state != 1){usleep(1);}
-		
-		//set status to processing
-		//*resample_state = 2;
+		input = handle_queue_pop(&soxr_data->filled, 1);
+		soxr_data->consumed++;
+	}
+
+	if(input != NULL)
+	{
+		soxr_data->input = input;
 		//process data
-		soxr_output(soxr, obuf, olen);
+		soxr_output(soxr, obuf16, olen);
+		//give the buffer back to the reader
+		handle_queue_push(&soxr_data->empty, input);
 		//resize to 8bit and clip value
-		//fprintf(stderr,"r\n");
 		i = 0;
 		while(i < FL2K_BUF_LEN)
 		{
@@ -468,15 +1241,8 @@ void fl2k_resample_to_freq(resample_data *soxr_data)
 			i++;
 		}
 	}
-	else//initialisation
+	else//first call, or nothing was read
 	{
-		//set status to ready
-		*resample_state = 1;
-			
-		//wait fl2K_callback to be ready
-		while(*process_state != 1){usleep(1);}
-		//set status to processing
-		//*resample_state = 2;
 		//set empty buffer while first data are processed
 		i = 0;
 		while(i < FL2K_BUF_LEN)
@@ -485,13 +1251,6 @@ void fl2k_resample_to_freq(resample_data *soxr_data)
 			i++;
 		}
 	}
-	
-	//set status to finished
-	*resample_state = 3;
-	//wait fl2K_callback to finish
-	while(*process_state != 3){usleep(1);}
-	
-	free(obuf);
 }
 
 //compute number of sample to skip
@@ -515,23 +1274,334 @@ unsigned long calc_nb_skip(long sample_cnt,int linelength,long frame_lengt,long
 		//if we stop in the middle of a skip
 		else if(((bufsize - linelength) < 0) && bufsize > 0)
 		{
-			nb_skip ++;
+			nb_skip ++;
+		}
+	}
+	
+	if(standard == 'P')
+	{
+		linelength -= 8;//remove the 4 extra sample from the last line
+	}
+	
+	return (nb_skip * linelength);//multiply for giving the number of byte to skip
+}
+
+/* 16 to 8 bit conversion and combining of two inputs
+ *
+ * Integer versions of the double precision rounding, bit exact with it:
+ * round(x / 256.0) is (x + 128) >> 8 for positive x and rounds half away
+ * from zero for negative x. Results wrap to 8 bit like the conversion of
+ * the double to unsigned char did. Each converts n samples of a (and b).
+ */
+#if defined(__GNUC__) && defined(__x86_64__)
+#define FILE_HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+typedef void (*convert_fn)(unsigned char *out, const unsigned char *a,
+			   const unsigned char *b, unsigned long n);
+
+//round(round(value16 / 256.0) / 1.34) + 64, combine mode 2 inside the active video
+static unsigned char cmb2_table[257];
+
+void convert_init(void)
+{
+	int t;
+
+	for (t = 0; t <= 256; t++)
+		cmb2_table[t] = round(t / 1.34) + 64;
+}
+
+#define U16(p, j)	((p)[2 * (j)] | ((p)[2 * (j) + 1] << 8))
+#define S16(p, j)	((short)U16(p, j))
+
+//8 bit, no processing
+static void convert_8(unsigned char *out, const unsigned char *a,
+		      const unsigned char *b, unsigned long n)
+{
+	memcpy(out, a, n);
+}
+
+//round(value16 / 256.0)
+static void convert_16(unsigned char *out, const unsigned char *a,
+		       const unsigned char *b, unsigned long n)
+{
+	unsigned long j = 0;
+#ifdef FILE_HAVE_SSE2
+	//the 16 bit sum wraps exactly where the 8 bit result does
+	const __m128i half = _mm_set1_epi16(128);
+	__m128i lo, hi;
+
+	for (; j + 16 <= n; j += 16)
+	{
+		lo = _mm_loadu_si128((const __m128i *)(a + 2 * j));
+		hi = _mm_loadu_si128((const __m128i *)(a + 2 * j + 16));
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, half), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, half), 8);
+		_mm_storeu_si128((__m128i *)(out + j), _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for (; j < n; j++)
+		out[j] = (U16(a, j) + 128) >> 8;
+}
+
+#ifdef FILE_HAVE_SSE2
+//round((s1 + s2) / 256.0) + 128 of 8 signed samples, as 16 bit lanes
+static inline __m128i convert_16_cmb0_8(const unsigned char *a, const unsigned char *b)
+{
+	const __m128i bias = _mm_set1_epi32(127);
+	const __m128i offset = _mm_set1_epi32(128);
+	const __m128i mask = _mm_set1_epi32(0xff);
+	__m128i va = _mm_loadu_si128((const __m128i *)a);
+	__m128i vb = _mm_loadu_si128((const __m128i *)b);
+	__m128i lo, hi;
+
+	lo = _mm_add_epi32(_mm_srai_epi32(_mm_unpacklo_epi16(va, va), 16),
+			   _mm_srai_epi32(_mm_unpacklo_epi16(vb, vb), 16));
+	hi = _mm_add_epi32(_mm_srai_epi32(_mm_unpackhi_epi16(va, va), 16),
+			   _mm_srai_epi32(_mm_unpackhi_epi16(vb, vb), 16));
+	//+1 for positive sums, ties round away from zero
+	lo = _mm_sub_epi32(_mm_add_epi32(lo, bias), _mm_cmpgt_epi32(lo, _mm_set1_epi32(-1)));
+	hi = _mm_sub_epi32(_mm_add_epi32(hi, bias), _mm_cmpgt_epi32(hi, _mm_set1_epi32(-1)));
+	lo = _mm_and_si128(_mm_add_epi32(_mm_srai_epi32(lo, 8), offset), mask);
+	hi = _mm_and_si128(_mm_add_epi32(_mm_srai_epi32(hi, 8), offset), mask);
+
+	return _mm_packs_epi32(lo, hi);
+}
+#endif
+
+//round((value16_signed + value16_2_signed) / 256.0) + 128
+static void convert_16_cmb0(unsigned char *out, const unsigned char *a,
+			    const unsigned char *b, unsigned long n)
+{
+	unsigned long j = 0;
+	int sum;
+#ifdef FILE_HAVE_SSE2
+	__m128i lo, hi;
+
+	for (; j + 16 <= n; j += 16)
+	{
+		lo = convert_16_cmb0_8(a + 2 * j, b + 2 * j);
+		hi = convert_16_cmb0_8(a + 2 * j + 16, b + 2 * j + 16);
+		_mm_storeu_si128((__m128i *)(out + j), _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for (; j < n; j++)
+	{
+		sum = S16(a, j) + S16(b, j);
+		out[j] = ((sum + 127 + (sum >= 0)) >> 8) + 128;
+	}
+}
+
+//round(((value16 + value16_2) / 2) / 256.0)
+static void convert_16_cmb1(unsigned char *out, const unsigned char *a,
+			    const unsigned char *b, unsigned long n)
+{
+	unsigned long j = 0;
+#ifdef FILE_HAVE_SSE2
+	const __m128i half = _mm_set1_epi16(128);
+	__m128i va, vb, lo, hi;
+
+	for (; j + 16 <= n; j += 16)
+	{
+		//floor((a + b) / 2) without overflowing 16 bit
+		va = _mm_loadu_si128((const __m128i *)(a + 2 * j));
+		vb = _mm_loadu_si128((const __m128i *)(b + 2 * j));
+		lo = _mm_add_epi16(_mm_and_si128(va, vb), _mm_srli_epi16(_mm_xor_si128(va, vb), 1));
+		va = _mm_loadu_si128((const __m128i *)(a + 2 * j + 16));
+		vb = _mm_loadu_si128((const __m128i *)(b + 2 * j + 16));
+		hi = _mm_add_epi16(_mm_and_si128(va, vb), _mm_srli_epi16(_mm_xor_si128(va, vb), 1));
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, half), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, half), 8);
+		_mm_storeu_si128((__m128i *)(out + j), _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for (; j < n; j++)
+		out[j] = (((U16(a, j) + U16(b, j)) / 2) + 128) >> 8;
+}
+
+//combine mode 2 inside the active video, the other samples are convert_16() of b
+static void convert_16_cmb2(unsigned char *out, const unsigned char *a,
+			    const unsigned char *b, unsigned long n)
+{
+	unsigned long j;
+
+	for (j = 0; j < n; j++)
+		out[j] = cmb2_table[(U16(a, j) + 128) >> 8];
+}
+
+//value8_signed + value8_2_signed + 128
+static void convert_8_cmb0(unsigned char *out, const unsigned char *a,
+			   const unsigned char *b, unsigned long n)
+{
+	unsigned long j = 0;
+#ifdef FILE_HAVE_SSE2
+	const __m128i offset = _mm_set1_epi8((char)0x80);
+	__m128i va, vb;
+
+	for (; j + 16 <= n; j += 16)
+	{
+		va = _mm_loadu_si128((const __m128i *)(a + j));
+		vb = _mm_loadu_si128((const __m128i *)(b + j));
+		_mm_storeu_si128((__m128i *)(out + j), _mm_add_epi8(_mm_add_epi8(va, vb), offset));
+	}
+#endif
+	for (; j < n; j++)
+		out[j] = a[j] + b[j] + 128;
+}
+
+//(value8 + value8_2) / 2
+static void convert_8_cmb1(unsigned char *out, const unsigned char *a,
+			   const unsigned char *b, unsigned long n)
+{
+	unsigned long j = 0;
+#ifdef FILE_HAVE_SSE2
+	const __m128i low7 = _mm_set1_epi8(0x7f);
+	__m128i va, vb;
+
+	for (; j + 16 <= n; j += 16)
+	{
+		va = _mm_loadu_si128((const __m128i *)(a + j));
+		vb = _mm_loadu_si128((const __m128i *)(b + j));
+		va = _mm_add_epi8(_mm_and_si128(va, vb),
+				  _mm_and_si128(_mm_srli_epi16(_mm_xor_si128(va, vb), 1), low7));
+		_mm_storeu_si128((__m128i *)(out + j), va);
+	}
+#endif
+	for (; j < n; j++)
+		out[j] = (a[j] + b[j]) / 2;
+}
+
+#undef U16
+#undef S16
+
+//chroma gain, IRE, signal gain, Vmax and sign of one channel as tables
+typedef struct level_lut {
+	int valid;
+	int identity;
+	double chroma_gain;
+	double ire_level;
+	double signal_gain;
+	double v_max;
+	int max_value;
+	int is_signed;
+	unsigned char table[2][2][256];//[in the chroma gain region][in the IRE region][sample]
+} level_lut;
+
+level_lut lut_r;
+level_lut lut_g;
+level_lut lut_b;
+
+//level shaping of one 8 bit sample, the tables are built from it
+static unsigned char level_shape(unsigned char value, int chroma, int ire, double chroma_gain,
+				 double ire_level, double signal_gain, double v_max,
+				 int max_value, int is_signed)
+{
+	//IRE
+	const float ire_conv = 1.59375;// (255/160)
+	const float ire_min = 63.75;//40 * (255/160)
+	const float ire_new_max = 159.375;// (140 * (255/160)) - (40 * (255/160))
+	const float ire_add = (ire_level * ire_conv);
+	const float ire_gain = (ire_new_max / (ire_new_max + ire_add));
+	double ire_tmp = 0;
+
+	//chroma gain
+	if(chroma_gain != 1 && chroma)
+	{
+		value = round(value / chroma_gain);// + cbust_offset;
+	}
+	
+	//ire 7.5 to ire 0
+	if(ire_level != 0 && ire)
+	{
+		ire_tmp = (value - ire_min);
+		
+		if(ire_tmp < 0)//clipping value
+		{
+			ire_tmp = 0;
+		}
+		ire_tmp = ire_tmp * ire_gain;
+		value = round(ire_tmp + ire_add + ire_min);
+	}
+	
+	//signal gain
+	if(signal_gain != 1)
+	{
+		if(value > 5)
+		{
+			if((value * signal_gain) > 255)
+			{
+				value = 255;
+			}
+			else
+			{
+				value = round(value * signal_gain);
+			}
+		}
+	}
+	
+	//scale to max voltage
+	if(v_max > 0.0)
+	{
+		if(round(value*(255/max_value)) > 255)
+		{
+			value = 255;
+		}
+		else
+		{
+			value = round((value*(255/max_value))/(0.7/v_max));
+		}
+	}
+	
+	//fix sign
+	if(!is_signed)
+	{
+		value = value - 128;
+	}
+	
+	return value;
+}
+
+//rebuild the tables if the parameters changed
+void level_lut_update(level_lut *lut, double chroma_gain, double ire_level, double signal_gain,
+		      double v_max, int max_value, int is_signed)
+{
+	int v, chroma, ire;
+
+	if(lut->valid && lut->chroma_gain == chroma_gain && lut->ire_level == ire_level &&
+	   lut->signal_gain == signal_gain && lut->v_max == v_max &&
+	   lut->max_value == max_value && lut->is_signed == is_signed)
+		return;
+
+	lut->identity = 1;
+	for(chroma = 0; chroma < 2; chroma++)
+	{
+		for(ire = 0; ire < 2; ire++)
+		{
+			for(v = 0; v < 256; v++)
+			{
+				lut->table[chroma][ire][v] = level_shape(v, chroma, ire, chroma_gain, ire_level,
+									 signal_gain, v_max, max_value, is_signed);
+				if(lut->table[chroma][ire][v] != v)
+					lut->identity = 0;
+			}
 		}
 	}
-	
-	if(standard == 'P')
-	{
-		linelength -= 8;//remove the 4 extra sample from the last line
-	}
-	
-	return (nb_skip * linelength);//multiply for giving the number of byte to skip
+
+	lut->chroma_gain = chroma_gain;
+	lut->ire_level = ire_level;
+	lut->signal_gain = signal_gain;
+	lut->v_max = v_max;
+	lut->max_value = max_value;
+	lut->is_signed = is_signed;
+	lut->valid = 1;
 }
 
 int read_sample_file(void *inpt_color)
 {
 	//parametter
 	char *buffer = NULL;
-	short *resbuffer = malloc(input_buf_size*2);//used for cast 8 bit to 16 bit
+	short *resbuffer = NULL;//used for cast 8 bit to 16 bit, handed to the resampler
 	FILE *stream = NULL;
 	FILE *stream2 = NULL;
 	FILE *streamA = NULL;
@@ -577,13 +1647,23 @@ int read_sample_file(void *inpt_color)
 	uint32_t *line_sample_cnt = NULL;
 	uint32_t *field_cnt = NULL;
 	
-	int *process_state = NULL;
-	int *resample_state = NULL;
+	resample_data *soxr_data = NULL;
+	channel_arena *arena = NULL;
+	mapped_input *map = NULL;
+	mapped_input *map2 = NULL;
+	prebuffer *pb = NULL;
+	prebuffer *pb2 = NULL;
+	int sample_type = 1;
 
 	if(color == 'R')
 	{
-		process_state = process_r_state_ptr;
-		resample_state = resample_r_state_ptr;
+		soxr_data = &soxr_data_r;
+		arena = &arena_r;
+		map = &map_r;
+		map2 = &map2_r;
+		pb = &pb_r;
+		pb2 = &pb2_r;
+		sample_type = sample_type_r;
 		buffer = inbuf_r;
 		stream = file_r;
 		stream2 = file2_r;
@@ -613,8 +1693,13 @@ int read_sample_file(void *inpt_color)
 	}
 	else if(color == 'G')
 	{
-		process_state = process_g_state_ptr;
-		resample_state = resample_g_state_ptr;
+		soxr_data = &soxr_data_g;
+		arena = &arena_g;
+		map = &map_g;
+		map2 = &map2_g;
+		pb = &pb_g;
+		pb2 = &pb2_g;
+		sample_type = sample_type_g;
 		buffer = inbuf_g;
 		stream = file_g;
 		stream2 = file2_g;
@@ -644,8 +1729,13 @@ int read_sample_file(void *inpt_color)
 	}
 	else if(color == 'B')
 	{
-		process_state = process_b_state_ptr;
-		resample_state = resample_b_state_ptr;
+		soxr_data = &soxr_data_b;
+		arena = &arena_b;
+		map = &map_b;
+		map2 = &map2_b;
+		pb = &pb_b;
+		pb2 = &pb2_b;
+		sample_type = sample_type_b;
 		buffer = inbuf_b;
 		stream = file_b;
 		stream2 = file2_b;
@@ -674,13 +1764,24 @@ int read_sample_file(void *inpt_color)
 		}
 	}
 	
-	//IRE
-	const float ire_conv = 1.59375;// (255/160)
-	const float ire_min = 63.75;//40 * (255/160)
-	const float ire_new_max = 159.375;// (140 * (255/160)) - (40 * (255/160))
-	const float ire_add = (*ire_level * ire_conv);
-	const float ire_gain = (ire_new_max / (ire_new_max + ire_add));
-	double ire_tmp = 0;
+	//level shaping tables
+	level_lut *lut = NULL;
+	int in_chroma = 0;
+	int in_ire = 0;
+	
+	if(color == 'R')
+	{
+		lut = &lut_r;
+	}
+	else if(color == 'G')
+	{
+		lut = &lut_g;
+	}
+	else
+	{
+		lut = &lut_b;
+	}
+	level_lut_update(lut, *chroma_gain, *ire_level, signal_gain, v_max, max_value, is_signed);
 	
 	if(video_standard == 'P')//PAL value multiplied by 2 if input is 16bit
 	{
@@ -715,33 +1816,60 @@ int read_sample_file(void *inpt_color)
 	
 	buf_size += sample_skip;
 	
-	unsigned char *tmp_buf = malloc(input_buf_size);//8bit data so we can use input_buf_size
-	unsigned char *audio_buf = malloc(audio_frame);
+	unsigned char *tmp_buf = arena->tmp_buf;//8bit data so we can use input_buf_size
+	unsigned char *audio_buf = arena->audio_buf;
 	char *audio_buf_signed = (void *)audio_buf;
-	unsigned char *calc = malloc(buf_size);
-	unsigned char *calc2 = malloc(buf_size);
-	unsigned short value16 = 0;
-	unsigned short value16_2 = 0;
-	unsigned char value8 = 0;
-	unsigned char value8_2 = 0;
-	
-	short *value16_signed = (void *)&value16;
-	short *value16_2_signed = (void *)&value16_2;
-	char *value8_signed = (void *)&value8;
-	char *value8_2_signed = (void *)&value8_2;
-	
-	//set status to ready
-	*process_state = 1;
-	//wait resampler
-	if(resample)while(*resample_state != 1){usleep(1);}
-	//set status to processing
-	//*process_state = 2;
-	
-	if (tmp_buf == NULL || calc == NULL)
-	{
-		free(tmp_buf);   // Free both in case only one was allocated
-		free(calc);
-		fprintf(stderr, "(%c) malloc error (tmp_buf , calc)\n",color);
+	unsigned char *calc = arena->calc;
+	unsigned char *calc2 = arena->calc2;
+	
+	//conversion of the input format and combine mode, chosen once
+	convert_fn convert = convert_8;
+	int cmb2 = 0;
+	unsigned long run = 0;//samples left that are already converted
+	unsigned long j_lo = 0;
+	unsigned long j_hi = 0;
+	const unsigned long step = 1 + is16;
+	//the frame boundary is only handled per sample if it does something
+	const int frame_events = istbc || (is_sync_a && isatty(STDOUT_FILENO) == 0);
+	
+	if(is16 == 1)
+	{
+		if(is_stereo)
+		{
+			if(combine_mode == 0)//default
+			{
+				convert = convert_16_cmb0;
+			}
+			else if(combine_mode == 2)
+			{
+				convert = convert_16;
+				cmb2 = 1;
+			}
+			else//mode 1
+			{
+				convert = convert_16_cmb1;
+			}
+		}
+		else
+		{
+			convert = convert_16;
+		}
+	}
+	else if(is_stereo)//combine 2 file
+	{
+		if(combine_mode == 0)//default
+		{
+			convert = convert_8_cmb0;
+		}
+		else//mode 1
+		{
+			convert = convert_8_cmb1;
+		}
+	}
+	
+	if (buf_size > arena->read_len)
+	{
+		fprintf(stderr, "(%c) read of %lu bytes does not fit the buffers\n",color,buf_size);
 		return -1;
 	}
 	
@@ -750,30 +1878,71 @@ int read_sample_file(void *inpt_color)
 		sample_skip = calc_nb_skip(*sample_cnt,line_lengt,frame_lengt,buf_size,video_standard);
 	}
 	
-	if(is_stereo)
+	//mapped files are read in place
+	map->direct = NULL;
+	if(pb->mem)
 	{
-		if(fread(calc,buf_size,1,stream) != 1 || fread(calc2,buf_size,1,stream2) != 1)
+		if(prebuffer_read(pb, calc, buf_size) < 0)
 		{
-			free(tmp_buf);   // Free both in case only one was allocated
-			free(calc);
-			free(calc2);
-			fprintf(stderr, "(%c) fread error %d : ",color,errno);
-			perror(NULL);
 			return -1;
 		}
 	}
-	else
+	else if(map->base)
+	{
+		calc = mapped_input_read(map, buf_size);
+		if(calc == NULL)
+		{
+			return -1;
+		}
+	}
+	else if(fread(calc,buf_size,1,stream) != 1)
+	{
+		fprintf(stderr, "(%c) fread error %d : ",color,errno);
+		perror(NULL);
+		return -1;
+	}
+	
+	if(is_stereo)
 	{
-		if(fread(calc,buf_size,1,stream) != 1)
+		if(pb2->mem)
+		{
+			if(prebuffer_read(pb2, calc2, buf_size) < 0)
+			{
+				return -1;
+			}
+		}
+		else if(map2->base)
+		{
+			calc2 = mapped_input_read(map2, buf_size);
+			if(calc2 == NULL)
+			{
+				return -1;
+			}
+		}
+		else if(fread(calc2,buf_size,1,stream2) != 1)
 		{
-			free(tmp_buf);   // Free both in case only one was allocated
-			free(calc);
-			free(calc2);
 			fprintf(stderr, "(%c) fread error %d : ",color,errno);
 			perror(NULL);
 			return -1;
 		}
 	}
+	
+	//8 bit samples without any processing are sent as read,
+	//unsigned input is handed over as unsigned instead of being shifted by 128
+	if(!is16 && !istbc && !is_stereo && *chroma_gain == 1 &&
+	   *ire_level == 0 && signal_gain == 1 && v_max <= 0.0 && !resample &&
+	   !use_pipe && !is_sync_a)
+	{
+		map->direct = (char *)calc;
+		map->direct_signed = is_signed ? sample_type : !sample_type;
+		return 0;
+	}
+
+	//wait for a buffer the resampler is done with
+	if(resample)
+	{
+		resbuffer = handle_queue_pop(&soxr_data->empty, 1);
+	}
 
 	while((y < buf_size) && !do_exit)
 	{	
@@ -799,90 +1968,79 @@ int read_sample_file(void *inpt_color)
 			if(isatty(STDOUT_FILENO) == 0 && is_sync_a)
 			{
 				//write(stdout, tmp_buf, input_buf_size);
-				fread(audio_buf_signed,audio_frame,1,streamA);
+				if(pb_audio.mem)
+				{
+					prebuffer_read(&pb_audio, audio_buf, audio_frame);
+				}
+				else
+				{
+					fread(audio_buf_signed,audio_frame,1,streamA);
+				}
 				//write(stdout, audio_buf_signed, audio_frame);
 				fwrite(audio_buf, audio_frame,1,stdout);
 				fflush(stdout);
 			}
 		}
 		
-		if(is16 == 1)
-		{
-			value16 = ((calc[y+1] * 256) + calc[y]);
-			if(is_stereo)
-			{
-				value16_2 = ((calc2[y+1] * 256) + calc2[y]);
-			}
-			y += 2;
-		}
-		else
+		//convert all samples up to the next frame (or line in combine mode 2) at once
+		if(run == 0)
 		{
-			value8 = calc[y];
-			if(is_stereo)
+			run = (buf_size - y + is16) / step;
+			if(frame_events)
 			{
-				value8_2 = calc2[y];
+				if(*sample_cnt >= frame_lengt)
+				{
+					run = 1;
+				}
+				else if((frame_lengt - *sample_cnt + is16) / step < run)
+				{
+					run = (frame_lengt - *sample_cnt + is16) / step;
+				}
 			}
-			y += 1;
-		}
-		
-		//convert 16bit to 8bit and combine
-		if(is16 == 1)
-		{
-			if(is_stereo)
+			
+			if(cmb2)
 			{
-				if(combine_mode == 0)//default
+				//the line and field only change at the end of a line
+				if(*line_cnt == ((frame_nb_line / 2) + ((unsigned long)*field_cnt % 2)))
 				{
-					if((round((*value16_signed + *value16_2_signed)/ 256.0) + 128) < -128)
-					{
-						tmp_buf[i] = -128;
-					}
-					/*else if((round((*value16_signed + *value16_2_signed)/ 256.0) + 128) > 0)
-					{
-						tmp_buf[i] = 0;
-					}*/
-					else
-					{
-						tmp_buf[i] = round((*value16_signed + *value16_2_signed)/ 256.0) + 128;//convert to 8 bit
-					}
+					run = 1;
 				}
-				else if(combine_mode == 2)
+				else if(*line_sample_cnt <= line_lengt && (line_lengt - *line_sample_cnt) / step + 1 < run)
 				{
-					if(((*line_sample_cnt >= v_start) && (*line_sample_cnt <= v_end))&& *line_cnt > (22 + ((unsigned long)*field_cnt % 2)) )
-					{
-						tmp_buf[i] = round(round((value16)  / 256.0) / 1.34) + 64;//convert to 8 bit
-					}
-					else
+					run = (line_lengt - *line_sample_cnt) / step + 1;
+				}
+				
+				//samples of the run inside the active video
+				j_lo = 0;
+				j_hi = 0;
+				if(*line_cnt > (22 + ((unsigned long)*field_cnt % 2)) && *line_sample_cnt <= v_end)
+				{
+					if(*line_sample_cnt < v_start)
 					{
-						tmp_buf[i] = round(value16_2 / 256.0);//convert to 8 bit
+						j_lo = (v_start - *line_sample_cnt + step - 1) / step;
 					}
-					
+					j_hi = (v_end - *line_sample_cnt) / step + 1;
+				}
+				if(j_hi > run)
+				{
+					j_hi = run;
 				}
-				else//mode 1
+				if(j_lo > j_hi)
 				{
-					tmp_buf[i] = round(((value16 + value16_2)/2)/ 256.0);//convert to 8 bit
+					j_lo = j_hi;
 				}
 				
+				convert_16(tmp_buf + i, calc2 + y, NULL, j_lo);
+				convert_16_cmb2(tmp_buf + i + j_lo, calc + y + j_lo * step, NULL, j_hi - j_lo);
+				convert_16(tmp_buf + i + j_hi, calc2 + y + j_hi * step, NULL, run - j_hi);
 			}
 			else
 			{
-				tmp_buf[i] = round(value16 / 256.0);//convert to 8 bit
-			}
-		}
-		else if(is_stereo)//combine 2 file
-		{
-			if(combine_mode == 0)//default
-			{
-				tmp_buf[i] = *value8_signed + *value8_2_signed + 128;
+				convert(tmp_buf + i, calc + y, is_stereo ? calc2 + y : NULL, run);
 			}
-			else//mode 1
-			{
-				tmp_buf[i] = round((value8 + value8_2)/2);
-			}
-		}
-		else//no processing
-		{
-			tmp_buf[i] = value8;
 		}
+		run--;
+		y += step;
 		
 		if(*chroma_gain != 1)
 		{
@@ -895,66 +2053,20 @@ int read_sample_file(void *inpt_color)
 				cbust_offset = (cbust_middle - (cbust_middle / *chroma_gain));
 			}
 			
-			//chroma gain
-			
-			if(((*line_sample_cnt >= cbust_start) && (*line_sample_cnt <= cbust_end * 1 + is16))&& (*line_cnt > (22 + ((unsigned long)*field_cnt % 2))))
-			{
-				tmp_buf[i] = round(tmp_buf[i] / *chroma_gain);// + cbust_offset;
-			}
-		}
-		
-		//ire 7.5 to ire 0
-		if (*ire_level != 0)
-		{
-			if(((*line_sample_cnt >= v_start) && (*line_sample_cnt <= v_end))&& *line_cnt > (22 + ((unsigned long)*field_cnt % 2)) )
-			{
-				ire_tmp = (tmp_buf[i] - ire_min);
-				
-				if(ire_tmp < 0)//clipping value
-				{
-					ire_tmp = 0;
-				}
-				ire_tmp = ire_tmp * ire_gain;
-				tmp_buf[i] =  round(ire_tmp + ire_add + ire_min);
-			}
-		}
-		
-		//signal gain
-		if(signal_gain != 1)
-		{
-			if(tmp_buf[i] > 5)
-			{
-				if((tmp_buf[i] * signal_gain) > 255)
-				{
-					tmp_buf[i] = 255;
-				}
-				else
-				{
-					tmp_buf[i] = round(tmp_buf[i] * signal_gain);
-				}
-			}
 		}
 		
-		//scale to max voltage
-		if(v_max > 0.0)
+		if(!lut->identity)
 		{
-			if(round(tmp_buf[i]*(255/max_value)) > 255)
-			{
-				tmp_buf[i] = 255;
-			}
-			else
-			{
-				tmp_buf[i] = round((tmp_buf[i]*(255/max_value))/(0.7/v_max));
-			}
+			//chroma gain
+			in_chroma = ((*line_sample_cnt >= cbust_start) && (*line_sample_cnt <= cbust_end * 1 + is16))&& (*line_cnt > (22 + ((unsigned long)*field_cnt % 2)));
+			//ire 7.5 to ire 0
+			in_ire = ((*line_sample_cnt >= v_start) && (*line_sample_cnt <= v_end))&& *line_cnt > (22 + ((unsigned long)*field_cnt % 2));
+			
+			//chroma gain, ire, signal gain, max voltage and sign
+			tmp_buf[i] = lut->table[in_chroma][in_ire][tmp_buf[i]];
 		}
 		
-		//fix sign and cast to 16 bit
-		if(!is_signed)
-		{
-			tmp_buf[i] = tmp_buf[i] - 128;
-			resbuffer[i] = tmp_buf[i];
-		}
-		else
+		if(resbuffer)
 		{
 			resbuffer[i] = tmp_buf[i];
 		}
@@ -980,25 +2092,11 @@ int read_sample_file(void *inpt_color)
 		*line_sample_cnt += (1 + is16);
 	}
 	
-	//set status to finished
-	*process_state = 3;
-	//wait resampler to finish
-	if(resample)while(*resample_state != 3){usleep(1);}
-	
 	if(resample)
 	{
-		if(color == 'R')
-		{
-			memcpy(resbuf_r, resbuffer, input_buf_size*2);
-		}
-		if(color == 'G')
-		{
-			memcpy(resbuf_g, resbuffer, input_buf_size*2);
-		}
-		if(color == 'B')
-		{
-			memcpy(resbuf_b, resbuffer, input_buf_size*2);
-		}
+		//the resampler picks it up on the next callback
+		handle_queue_push(&soxr_data->filled, resbuffer);
+		soxr_data->pushed++;
 	}
 	else
 	{
@@ -1022,14 +2120,119 @@ int read_sample_file(void *inpt_color)
 		fflush(stdout);
 	}
 	
-	free(resbuffer);
-	free(tmp_buf);
-	free(audio_buf);
-	free(calc);
-	free(calc2);
 	return 0;
 }
 
+static void pin_thread(int cpu)
+{
+#if defined(__linux__)
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		fprintf(stderr, "Failed to pin thread to cpu %d\n", cpu);
+#elif defined(_WIN32)
+	if (!SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu))
+		fprintf(stderr, "Failed to pin thread to cpu %d\n", cpu);
+#else
+	fprintf(stderr, "Cpu pinning is not supported on this platform\n");
+#endif
+}
+
+static void *channel_worker_loop(void *arg)
+{
+	channel_worker *w = arg;
+
+	if (w->cpu >= 0)
+		pin_thread(w->cpu);
+
+	pthread_mutex_lock(&w->lock);
+	while (1)
+	{
+		while (w->done == w->posted && !w->stop)
+			pthread_cond_wait(&w->cond, &w->lock);
+
+		if (w->done == w->posted)//stop, nothing left to do
+			break;
+
+		pthread_mutex_unlock(&w->lock);
+		w->job(w->arg);
+		pthread_mutex_lock(&w->lock);
+
+		w->done++;
+		pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+int channel_worker_start(channel_worker *w, void (*job)(void *), void *arg, int cpu)
+{
+	w->job = job;
+	w->arg = arg;
+	w->cpu = cpu;
+	w->posted = 0;
+	w->done = 0;
+	w->stop = 0;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+
+	if (pthread_create(&w->thread, NULL, channel_worker_loop, w) != 0)
+	{
+		fprintf(stderr, "Failed to start worker thread\n");
+		return -1;
+	}
+
+	w->running = 1;
+	return 0;
+}
+
+//run the job once more
+void channel_worker_post(channel_worker *w)
+{
+	pthread_mutex_lock(&w->lock);
+	w->posted++;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+//wait until all posted jobs are done
+void channel_worker_wait(channel_worker *w)
+{
+	pthread_mutex_lock(&w->lock);
+	while (w->done != w->posted)
+		pthread_cond_wait(&w->cond, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+}
+
+void channel_worker_stop(channel_worker *w)
+{
+	if (!w->running)
+		return;
+
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	pthread_join(w->thread, NULL);
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->cond);
+	w->running = 0;
+}
+
+static void read_job(void *color)
+{
+	read_sample_file(color);
+}
+
+static void resample_job(void *soxr_data)
+{
+	fl2k_resample_to_freq(soxr_data);
+}
+
 void fl2k_callback(fl2k_data_info_t *data_info)
 {	
 	static uint32_t repeat_cnt = 0;
@@ -1044,6 +2247,12 @@ void fl2k_callback(fl2k_data_info_t *data_info)
 		do_exit = 1;
 		return;
 	}
+
+	if (data_info->drained) {
+		fprintf(stderr, "All samples sent, exiting.\n");
+		do_exit = 1;
+		return;
+	}
 	
 	//set sign (signed = 1 , unsigned = 0)
 	data_info->sampletype_signed_r = sample_type_r;
@@ -1053,7 +2262,6 @@ void fl2k_callback(fl2k_data_info_t *data_info)
 	//send the bufer with a size of (1280 * 1024) = 1310720
 	if(red == 1)
 	{
-		data_info->r_buf_res = resbuf_r;
 		data_info->r_buf = outbuf_r;
 		data_info->r_buf_len = input_buf_size*2;
 		data_info->r_rate = input_sample_rate;
@@ -1061,7 +2269,6 @@ void fl2k_callback(fl2k_data_info_t *data_info)
 	}
 	if(green == 1)
 	{
-		data_info->g_buf_res = resbuf_g;
 		data_info->g_buf = outbuf_g;
 		data_info->g_buf_len = input_buf_size*2;
 		data_info->g_rate = input_sample_rate;
@@ -1069,7 +2276,6 @@ void fl2k_callback(fl2k_data_info_t *data_info)
 	}
 	if(blue == 1)
 	{
-		data_info->b_buf_res = resbuf_b;
 		data_info->b_buf = outbuf_b;
 		data_info->b_buf_len = input_buf_size*2;
 		data_info->b_rate = input_sample_rate;
@@ -1078,53 +2284,49 @@ void fl2k_callback(fl2k_data_info_t *data_info)
 	
 	//initialisation
 	//start resampler if not initialisaed
-	if(soxr_data_r.state_process == 0 && red == 1)
+	if(soxr_data_r.soxr == NULL && red == 1)
 	{
 		resampler_open(data_info, &resampler_r,fl2k_get_sample_rate(dev), 'R');
 		//resampling data
 		soxr_data_r.soxr = resampler_r;
-		soxr_data_r.state_process = &process_r_state;
-		soxr_data_r.state_resample = &resample_r_state;
 		soxr_data_r.data_info = data_info;
 		soxr_data_r.color = 'R';
 	}
-	if(soxr_data_g.state_process == 0 && green == 1)
+	if(soxr_data_g.soxr == NULL && green == 1)
 	{
 		resampler_open(data_info, &resampler_g, fl2k_get_sample_rate(dev), 'G');
 		fprintf(stderr,"engine outside = %s\n",soxr_engine(resampler_g));
 		//resampling data
 		soxr_data_g.soxr = resampler_g;
-		soxr_data_g.state_process = &process_g_state;
-		soxr_data_g.state_resample = &resample_g_state;
 		soxr_data_g.data_info = data_info;
 		soxr_data_g.color = 'G';
 	}
-	if(soxr_data_b.state_process == 0 && blue == 1)
+	if(soxr_data_b.soxr == NULL && blue == 1)
 	{
 		resampler_open(data_info, &resampler_b, fl2k_get_sample_rate(dev), 'B');
 		//resampling data
 		soxr_data_b.soxr = resampler_b;
-		soxr_data_b.state_process = &process_b_state;
-		soxr_data_b.state_resample = &resample_b_state;
 		soxr_data_b.data_info = data_info;
 		soxr_data_b.color = 'B';
 	}
 	
 	//read until buffer is full
 	//RED
-	if(red == 1 && !feof(file_r))
+	if(red == 1 && !channel_eof(file_r, &map_r, &pb_r))
 	{
+		//buffers the resampler may take, counted before the reader starts
+		soxr_data_r.ready = soxr_data_r.pushed - soxr_data_r.consumed;
 		//process file
-		pthread_create(&thread_r,NULL,read_sample_file,'R');
+		channel_worker_post(&thread_r);
 		//resample
-		if(resample)pthread_create(&thread_r_res,NULL,fl2k_resample_to_freq,&soxr_data_r);
+		if(resample)channel_worker_post(&thread_r_res);
 
 		if (ferror(file_r))
 		{
 			fprintf(stderr, "(RED) : File Error\n");
 		}
 	}
-	else if(red == 1 && feof(file_r))
+	else if(red == 1 && channel_eof(file_r, &map_r, &pb_r))
 	{
 		fprintf(stderr, "(RED) : Nothing more to read\n");
 	}
@@ -1134,24 +2336,26 @@ void fl2k_callback(fl2k_data_info_t *data_info)
 	{
 		if(red == 1)
 		{
-			pthread_join(thread_r,NULL);
-			if(resample)pthread_join(thread_r_res,NULL);
+			channel_worker_wait(&thread_r);
+			if(resample)channel_worker_wait(&thread_r_res);
 		}
 	}
 	
 	//GREEN
-	if(green == 1 && !feof(file_g))
+	if(green == 1 && !channel_eof(file_g, &map_g, &pb_g))
 	{
-		pthread_create(&thread_g,NULL,read_sample_file,'G');
+		//buffers the resampler may take, counted before the reader starts
+		soxr_data_g.ready = soxr_data_g.pushed - soxr_data_g.consumed;
+		channel_worker_post(&thread_g);
 		//resample
-		if(resample)pthread_create(&thread_g_res,NULL,fl2k_resample_to_freq,&soxr_data_g);
+		if(resample)channel_worker_post(&thread_g_res);
 		
 		if (ferror(file_g))
 		{
 			fprintf(stderr, "(GREEN) : File Error\n");
 		}
 	}
-	else if(green == 1 && feof(file_g))
+	else if(green == 1 && channel_eof(file_g, &map_g, &pb_g))
 	{
 		fprintf(stderr, "(GREEN) : Nothing more to read\n");
 	}
@@ -1161,37 +2365,39 @@ void fl2k_callback(fl2k_data_info_t *data_info)
 	{
 		if(green == 1)
 		{
-			pthread_join(thread_g,NULL);
-			if(resample)pthread_join(thread_g_res,NULL);
+			channel_worker_wait(&thread_g);
+			if(resample)channel_worker_wait(&thread_g_res);
 		}
 	}
 	else if(read_mode == 2)
 	{
 		if(red == 1)
 		{
-			pthread_join(thread_r,NULL);
-			if(resample)pthread_join(thread_r_res,NULL);
+			channel_worker_wait(&thread_r);
+			if(resample)channel_worker_wait(&thread_r_res);
 		}
 		if(green == 1)
 		{
-			pthread_join(thread_g,NULL);
-			if(resample)pthread_join(thread_g_res,NULL);
+			channel_worker_wait(&thread_g);
+			if(resample)channel_worker_wait(&thread_g_res);
 		}
 	}
 	
 	//BLUE
-	if(blue == 1 && !feof(file_b))
+	if(blue == 1 && !channel_eof(file_b, &map_b, &pb_b))
 	{
-		pthread_create(&thread_b,NULL,read_sample_file,'B');
+		//buffers the resampler may take, counted before the reader starts
+		soxr_data_b.ready = soxr_data_b.pushed - soxr_data_b.consumed;
+		channel_worker_post(&thread_b);
 		//resample
-		if(resample)pthread_create(&thread_b_res,NULL,fl2k_resample_to_freq,&soxr_data_b);
+		if(resample)channel_worker_post(&thread_b_res);
 		
 		if(ferror(file_b))
 		{
 			fprintf(stderr, "(BLUE) : File Error\n");
 		}
 	}
-	else if(blue == 1 && feof(file_b))
+	else if(blue == 1 && channel_eof(file_b, &map_b, &pb_b))
 	{
 		fprintf(stderr, "(BLUE) : Nothing more to read\n");
 	}
@@ -1201,42 +2407,59 @@ void fl2k_callback(fl2k_data_info_t *data_info)
 	{
 		if(red == 1)
 		{
-			pthread_join(thread_r,NULL);
-			if(resample)pthread_join(thread_r_res,NULL);
+			channel_worker_wait(&thread_r);
+			if(resample)channel_worker_wait(&thread_r_res);
 		}
 		if(green == 1)
 		{
-			pthread_join(thread_g,NULL);
-			if(resample)pthread_join(thread_g_res,NULL);
+			channel_worker_wait(&thread_g);
+			if(resample)channel_worker_wait(&thread_g_res);
 		}
 		if(blue == 1)
 		{
-			pthread_join(thread_b,NULL);
-			if(resample)pthread_join(thread_b_res,NULL);
+			channel_worker_wait(&thread_b);
+			if(resample)channel_worker_wait(&thread_b_res);
 		}
 	}
 	else if(read_mode == 3 || read_mode == 2)
 	{
 		if(blue == 1)
 		{
-			pthread_join(thread_b,NULL);
-			if(resample)pthread_join(thread_b_res,NULL);
+			channel_worker_wait(&thread_b);
+			if(resample)channel_worker_wait(&thread_b_res);
 		}
 	}
 	else if(read_mode == 1)
 	{
 		if(green == 1)
 		{
-			pthread_join(thread_g,NULL);
-			if(resample)pthread_join(thread_g_res,NULL);
+			channel_worker_wait(&thread_g);
+			if(resample)channel_worker_wait(&thread_g_res);
 		}
 		if(blue == 1)
 		{
-			pthread_join(thread_b,NULL);
-			if(resample)pthread_join(thread_b_res,NULL);
+			channel_worker_wait(&thread_b);
+			if(resample)channel_worker_wait(&thread_b_res);
 		}
 	}
 	
+	//zero-copy channels point straight into the input mapping
+	if(red == 1 && map_r.direct)
+	{
+		data_info->r_buf = map_r.direct;
+		data_info->sampletype_signed_r = map_r.direct_signed;
+	}
+	if(green == 1 && map_g.direct)
+	{
+		data_info->g_buf = map_g.direct;
+		data_info->sampletype_signed_g = map_g.direct_signed;
+	}
+	if(blue == 1 && map_b.direct)
+	{
+		data_info->b_buf = map_b.direct;
+		data_info->sampletype_signed_b = map_b.direct_signed;
+	}
+	
 	//close threads
 	/*if(red == 1)
 	{
@@ -1254,11 +2477,11 @@ void fl2k_callback(fl2k_data_info_t *data_info)
 		pthread_exit(thread_b_res);
 	}*/
 	
-	if((red == 0 || feof(file_r)) && (green == 0 || feof(file_g)) && (blue == 0 || feof(file_b)))
+	if((red == 0 || channel_eof(file_r, &map_r, &pb_r)) && (green == 0 || channel_eof(file_g, &map_g, &pb_g)) && (blue == 0 || channel_eof(file_b, &map_b, &pb_b)))
 	{
 		fprintf(stderr, "End of the process\n");
-		fl2k_stop_tx(dev);
-		do_exit = 1;
+		/* send the buffers still queued, exit when drained */
+		fl2k_drain_tx(dev);
 	}
 	
 	/*if(!(green == 1 && feof(file_g)) || !(green == 1 && feof(file_g)) && !(green == 1 && feof(file_g)))
@@ -1275,7 +2498,7 @@ void fl2k_callback(fl2k_data_info_t *data_info)
 int main(int argc, char **argv)
 {
 #ifndef _WIN32
-	struct sigaction sigact, sigign;
+	struct sigaction sigact, sigign, sigusr1;
 #endif
 
 #ifdef _WIN32 || _WIN64
@@ -1373,6 +2596,13 @@ int main(int argc, char **argv)
 		{"MaxValueG", 1, 0, 42},
 		{"MaxValueB", 1, 0, 43},
 		{"resample", 0, 0, 44},
+		{"cpuR", 1, 0, 45},
+		{"cpuG", 1, 0, 46},
+		{"cpuB", 1, 0, 47},
+		{"lockMem", 0, 0, 48},
+		{"bufHigh", 1, 0, 49},
+		{"bufLow", 1, 0, 50},
+		{"directIO", 0, 0, 51},
 		{0, 0, 0, 0}//reminder : letter value are from 65 to 122
 	};
 
@@ -1567,6 +2797,27 @@ int main(int argc, char **argv)
 		case 44:
 			resample = 1;
 			break;
+		case 45:
+			cpu_r = atoi(optarg);
+			break;
+		case 46:
+			cpu_g = atoi(optarg);
+			break;
+		case 47:
+			cpu_b = atoi(optarg);
+			break;
+		case 48:
+			lock_mem = 1;
+			break;
+		case 49:
+			buf_high = atof(optarg);
+			break;
+		case 50:
+			buf_low = atof(optarg);
+			break;
+		case 51:
+			use_direct_io = 1;
+			break;
 		default:
 			usage();
 			break;
@@ -1801,6 +3052,7 @@ if(red == 1)
 	if (strcmp(filename_r, "-") == 0)/* Read samples from stdin */
 	{
 		file_r = stdin;
+		input_open(file_r, NULL, 0, r16, &map_r, &pb_r);
 	}
 	else
 	{
@@ -1812,16 +3064,22 @@ if(red == 1)
 		else
 		{
 			FSEEK(file_r,start_r,0);
+			input_open(file_r, filename_r, start_r, r16, &map_r, &pb_r);
 		}
 	}
 
 	inbuf_r = malloc(input_buf_size);
-	resbuf_r = malloc(input_buf_size*2);
-	outbuf_r = malloc(FL2K_BUF_LEN);
-	if (!inbuf_r || !resbuf_r || !outbuf_r) {
+	//never written while the channel is sent zero-copy, so a failed
+	//read at the end sends zeros instead of uninitialised memory
+	outbuf_r = calloc(1, FL2K_BUF_LEN);
+	if (!inbuf_r || !outbuf_r || channel_arena_init(&arena_r, r16, tbcR, red2) < 0) {
 		fprintf(stderr, "(RED) : malloc error!\n");
 		goto out;
 	}
+	if(resample)
+	{
+		resample_pool_init(&soxr_data_r, &arena_r);
+	}
 	
 }
 
@@ -1830,6 +3088,7 @@ if(red2 == 1)
 	if (strcmp(filename2_r, "-") == 0)/* Read samples from stdin */
 	{ 
 		file2_r = stdin;
+		input_open(file2_r, NULL, 0, r16, &map2_r, &pb2_r);
 	}
 	else 
 	{
@@ -1841,6 +3100,7 @@ if(red2 == 1)
 		else
 		{
 			FSEEK(file2_r,start_r,0);
+			input_open(file2_r, filename2_r, start_r, r16, &map2_r, &pb2_r);
 		}
 	}
 }
@@ -1851,6 +3111,7 @@ if(green == 1)
 	if (strcmp(filename_g, "-") == 0)/* Read samples from stdin */
 	{
 		file_g = stdin;
+		input_open(file_g, NULL, 0, g16, &map_g, &pb_g);
 	}
 	else
 	{
@@ -1862,16 +3123,20 @@ if(green == 1)
 		else
 		{
 			FSEEK(file_g,start_g,0);
+			input_open(file_g, filename_g, start_g, g16, &map_g, &pb_g);
 		}
 	}
 
 	inbuf_g = malloc(input_buf_size);
-	resbuf_g = malloc(input_buf_size*2);
-	outbuf_g = malloc(FL2K_BUF_LEN);
-	if (!inbuf_g || !resbuf_g || !outbuf_g) {
+	outbuf_g = calloc(1, FL2K_BUF_LEN);
+	if (!inbuf_g || !outbuf_g || channel_arena_init(&arena_g, g16, tbcG, green2) < 0) {
 		fprintf(stderr, "(GREEN) : malloc error!\n");
 		goto out;
 	}
+	if(resample)
+	{
+		resample_pool_init(&soxr_data_g, &arena_g);
+	}
 }
 
 if(green2 == 1)
@@ -1879,6 +3144,7 @@ if(green2 == 1)
 	if (strcmp(filename2_g, "-") == 0)/* Read samples from stdin */
 	{ 
 		file2_g = stdin;
+		input_open(file2_g, NULL, 0, g16, &map2_g, &pb2_g);
 	}
 	else 
 	{
@@ -1890,6 +3156,7 @@ if(green2 == 1)
 		else
 		{
 			FSEEK(file2_g,start_g,0);
+			input_open(file2_g, filename2_g, start_g, g16, &map2_g, &pb2_g);
 		}
 	}
 }
@@ -1900,6 +3167,7 @@ if(blue == 1)
 	if (strcmp(filename_b, "-") == 0)/* Read samples from stdin */
 	{
 		file_b = stdin;
+		input_open(file_b, NULL, 0, b16, &map_b, &pb_b);
 	}
 	else
 	{
@@ -1911,16 +3179,20 @@ if(blue == 1)
 		else
 		{
 			FSEEK(file_b,start_b,0);
+			input_open(file_b, filename_b, start_b, b16, &map_b, &pb_b);
 		}
 	}
 
 	inbuf_b = malloc(input_buf_size);
-	resbuf_b = malloc(input_buf_size*2);
-	outbuf_b = malloc(FL2K_BUF_LEN);
-	if (!inbuf_b || !resbuf_b || !outbuf_b) {
+	outbuf_b = calloc(1, FL2K_BUF_LEN);
+	if (!inbuf_b || !outbuf_b || channel_arena_init(&arena_b, b16, tbcB, blue2) < 0) {
 		fprintf(stderr, "(BLUE) : malloc error!\n");
 		goto out;
 	}
+	if(resample)
+	{
+		resample_pool_init(&soxr_data_b, &arena_b);
+	}
 }
 
 if(blue2 == 1)
@@ -1928,6 +3200,7 @@ if(blue2 == 1)
 	if (strcmp(filename2_b, "-") == 0)/* Read samples from stdin */
 	{ 
 		file2_b = stdin;
+		input_open(file2_b, NULL, 0, b16, &map2_b, &pb2_b);
 	}
 	else 
 	{
@@ -1939,6 +3212,7 @@ if(blue2 == 1)
 		else
 		{
 			FSEEK(file2_b,start_b,0);
+			input_open(file2_b, filename2_b, start_b, b16, &map2_b, &pb2_b);
 		}
 	}
 }
@@ -1948,6 +3222,8 @@ if(audio == 1)
 	if (strcmp(filename_audio, "-") == 0)/* Read samples from stdin */
 	{ 
 		file_audio = stdin;
+		if(buf_high > 0)
+			prebuffer_open(&pb_audio, file_audio, NULL, 0, AUDIO_FRAME_MAX * 25, AUDIO_FRAME_MAX);
 	}
 	else 
 	{
@@ -1959,11 +3235,46 @@ if(audio == 1)
 		else
 		{
 			FSEEK(file_audio,start_audio,0);
+			if(buf_high > 0)
+				prebuffer_open(&pb_audio, file_audio, filename_audio, start_audio, AUDIO_FRAME_MAX * 25, AUDIO_FRAME_MAX);
 		}
 	}
 }
 
-//start fl2K
+//conversion tables
+convert_init();
+
+//start the channel workers once, they are reused for every buffer
+if(red == 1)
+{
+	if(channel_worker_start(&thread_r, read_job, (void *)'R', cpu_r) < 0 ||
+	   (resample && channel_worker_start(&thread_r_res, resample_job, &soxr_data_r, cpu_r) < 0))
+		goto out;
+}
+if(green == 1)
+{
+	if(channel_worker_start(&thread_g, read_job, (void *)'G', cpu_g) < 0 ||
+	   (resample && channel_worker_start(&thread_g_res, resample_job, &soxr_data_g, cpu_g) < 0))
+		goto out;
+}
+if(blue == 1)
+{
+	if(channel_worker_start(&thread_b, read_job, (void *)'B', cpu_b) < 0 ||
+	   (resample && channel_worker_start(&thread_b_res, resample_job, &soxr_data_b, cpu_b) < 0))
+		goto out;
+}
+
+//fill the prebuffers before the first transfer
+prebuffer_fill(&pb_r);
+prebuffer_fill(&pb_g);
+prebuffer_fill(&pb_b);
+prebuffer_fill(&pb2_r);
+prebuffer_fill(&pb2_g);
+prebuffer_fill(&pb2_b);
+prebuffer_fill(&pb_audio);
+
+//start fl2K with real samples in all transfers, not with a blank burst
+fl2k_set_prefill(dev, 1000);
 r = fl2k_start_tx(dev, fl2k_callback, NULL, 0);
 
 
@@ -1972,10 +3283,14 @@ r = fl2k_start_tx(dev, fl2k_callback, NULL, 0);
 	sigemptyset(&sigact.sa_mask);
 	sigact.sa_flags = 0;
 	sigign.sa_handler = SIG_IGN;
+	sigusr1.sa_handler = sigusr1_handler;
+	sigemptyset(&sigusr1.sa_mask);
+	sigusr1.sa_flags = SA_RESTART;
 	sigaction(SIGINT, &sigact, NULL);
 	sigaction(SIGTERM, &sigact, NULL);
 	sigaction(SIGQUIT, &sigact, NULL);
 	sigaction(SIGPIPE, &sigign, NULL);
+	sigaction(SIGUSR1, &sigusr1, NULL);
 #else
 	SetConsoleCtrlHandler( (PHANDLER_ROUTINE) sighandler, TRUE );
 #endif
@@ -1987,6 +3302,24 @@ r = fl2k_start_tx(dev, fl2k_callback, NULL, 0);
 
 out:
 
+//stop channel workers
+	channel_worker_stop(&thread_r);
+	channel_worker_stop(&thread_g);
+	channel_worker_stop(&thread_b);
+	channel_worker_stop(&thread_r_res);
+	channel_worker_stop(&thread_g_res);
+	channel_worker_stop(&thread_b_res);
+
+//stop the readers
+	io_sched_stop();
+	prebuffer_close(&pb_r);
+	prebuffer_close(&pb_g);
+	prebuffer_close(&pb_b);
+	prebuffer_close(&pb2_r);
+	prebuffer_close(&pb2_g);
+	prebuffer_close(&pb2_b);
+	prebuffer_close(&pb_audio);
+
 //close resampler
 	if(resampler_r && red == 1)
 	{
@@ -2011,10 +3344,7 @@ out:
 			free(inbuf_r);
 		}
 		
-		if (resbuf_r)
-		{
-			free(resbuf_r);
-		}
+		channel_arena_free(&arena_r);
 		
 		if(outbuf_r)
 		{
@@ -2023,6 +3353,7 @@ out:
 
 		if (file_r && (file_r != stdin))
 		{
+			mapped_input_close(&map_r);
 			fclose(file_r);
 		}
 	}
@@ -2031,6 +3362,7 @@ out:
 	{
 		if (file2_r && (file2_r != stdin))
 		{
+			mapped_input_close(&map2_r);
 			fclose(file2_r);
 		}
 	}
@@ -2042,10 +3374,7 @@ out:
 			free(inbuf_g);
 		}
 		
-		if (resbuf_g)
-		{
-			free(resbuf_g);
-		}
+		channel_arena_free(&arena_g);
 		
 		if(outbuf_g)
 		{
@@ -2054,6 +3383,7 @@ out:
 
 		if (file_g && (file_g != stdin))
 		{
+			mapped_input_close(&map_g);
 			fclose(file_g);
 		}
 	}
@@ -2062,6 +3392,7 @@ out:
 	{
 		if (file2_g && (file2_g != stdin))
 		{
+			mapped_input_close(&map2_g);
 			fclose(file2_g);
 		}
 	}
@@ -2074,10 +3405,7 @@ out:
 			free(inbuf_b);
 		}
 		
-		if (resbuf_b)
-		{
-			free(resbuf_b);
-		}
+		channel_arena_free(&arena_b);
 		
 		if(outbuf_b)
 		{
@@ -2086,6 +3414,7 @@ out:
 
 		if (file_b && (file_b != stdin))
 		{
+			mapped_input_close(&map_b);
 			fclose(file_b);
 		}
 	}
@@ -2094,6 +3423,7 @@ out:
 	{
 		if (file2_b && (file2_b != stdin))
 		{
+			mapped_input_close(&map2_b);
 			fclose(file2_b);
 		}
 	}
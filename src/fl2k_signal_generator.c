@@ -373,6 +373,11 @@ void fl2k_callback(fl2k_data_info_t *data_info)
 	data_info->sampletype_signed_g = 0;
 	data_info->sampletype_signed_b = 0;
 	
+	//channels without signal stay at 0, no need to rewrite them
+	data_info->r_gen = red ? 0 : 1;
+	data_info->g_gen = green ? 0 : 1;
+	data_info->b_gen = blue ? 0 : 1;
+
 	//send the bufer with a size of 1310720
 	if(red == 1)
 	{
@@ -26,17 +26,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <time.h>
 #include "libusb.h"
 #include <pthread.h>
 
 #ifndef _WIN32
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #define sleep_ms(ms)	usleep(ms*1000)
 #else
 #include <windows.h>
 #define sleep_ms(ms)	Sleep(ms)
 #endif
 
+#if defined(__GNUC__)
+#define fl2k_atomic_add(p, v)	__sync_fetch_and_add(p, v)
+#else
+#define fl2k_atomic_add(p, v)	((*(p) += (v)) - (v))
+#endif
+
 /*
  * All libusb callback functions should be marked with the LIBUSB_CALL macro
  * to ensure that they are compiled with the same calling convention as libusb.
@@ -65,12 +76,122 @@ typedef enum fl2k_buf_state {
 	BUF_EMPTY = 0,
 	BUF_SUBMITTED,
 	BUF_FILLED,
+	BUF_FILLING,
 } fl2k_buf_state_t;
 
+enum fl2k_trace_type {
+	FL2K_TRACE_CALLBACK = 0,
+	FL2K_TRACE_CONVERT,
+	FL2K_TRACE_SUBMIT,
+	FL2K_TRACE_COMPLETE,
+	FL2K_TRACE_UNDERFLOW,
+	FL2K_TRACE_WAIT,
+};
+
+/* one trace ring per library thread */
+enum fl2k_trace_thread {
+	FL2K_RING_USB = 0,
+	FL2K_RING_SAMPLE,		/* first sample worker */
+	FL2K_TRACE_RINGS = FL2K_RING_SAMPLE + FL2K_MAX_PRODUCERS
+};
+
+typedef struct fl2k_trace_event {
+	uint64_t ts;			/* ns, monotonic clock */
+	uint32_t arg;			/* transfer sequence number */
+	uint16_t type;
+	char phase;			/* 'B'egin, 'E'nd or 'i'nstant */
+} fl2k_trace_event_t;
+
+typedef struct fl2k_trace_ring {
+	fl2k_trace_event_t *ev;
+	uint32_t mask;
+	volatile uint32_t head;
+	volatile int wrapped;		/* all slots were written once */
+} fl2k_trace_ring_t;
+
+typedef struct fl2k_trace {
+	fl2k_trace_ring_t ring[FL2K_TRACE_RINGS];
+	uint32_t events;		/* per ring, power of two */
+	uint64_t t0;
+	char *path;
+	volatile int dump_req;
+	volatile int dump_busy;
+} fl2k_trace_t;
+
+#define FL2K_LAT_BUCKETS	10
+
+/* counters, only written by the TX threads */
+typedef struct fl2k_stats {
+	volatile uint64_t callbacks;
+	volatile uint64_t cb_ns_sum;
+	volatile uint64_t cb_hist[FL2K_LAT_BUCKETS];
+	volatile uint64_t xfers_completed;
+	volatile uint64_t last_complete_ns;
+	volatile uint64_t underflows;
+	volatile uint64_t dev_lost;
+	volatile uint32_t queue_depth;
+} fl2k_stats_t;
+
+typedef struct fl2k_publisher {
+	char *path;
+	int fd;				/* listening socket, or -1 for a file */
+} fl2k_publisher_t;
+
+typedef struct fl2k_metrics {
+	fl2k_publisher_t pub;
+	uint32_t interval_ms;
+	pthread_t thread;
+	volatile int terminate;
+
+	/* sample rate measurement */
+	uint64_t last_cnt;
+	uint64_t last_ns;
+	double measured_rate;
+	double ppm;
+} fl2k_metrics_t;
+
+typedef struct fl2k_spectrum {
+	fl2k_publisher_t pub;
+	uint32_t interval_ms;
+	uint32_t fft_len;
+	pthread_t thread;
+	volatile int terminate;
+
+	/* snapshot of the first fft_len * 3 bytes of a transfer */
+	pthread_mutex_t lock;
+	uint8_t *snap;
+	uint64_t snap_seq;
+	volatile int want;		/* requested by the monitor */
+	int ready;			/* taken by a sample worker */
+	volatile uint64_t dropped;	/* lock was busy */
+	uint64_t snapshots;
+
+	float *window;
+	float *re, *im;
+	char *out;
+	size_t out_size;
+} fl2k_spectrum_t;
+
+#define FL2K_RATE_QUEUE		16
+
+/* sample rate change, prepared for submission from the USB callback */
+typedef struct fl2k_rate_change {
+	uint64_t seq;			/* first transfer with the new rate */
+	struct libusb_transfer *xfer;	/* write of PLL register 0x802c */
+} fl2k_rate_change_t;
+
+/* a sample worker thread, the conversion state lives on its stack */
+typedef struct fl2k_worker {
+	fl2k_dev_t *dev;
+	pthread_t thread;
+	unsigned int ring;		/* trace ring of the thread */
+} fl2k_worker_t;
+
 typedef struct fl2k_xfer_info {
 	fl2k_dev_t *dev;
 	uint64_t seq;
 	fl2k_buf_state_t state;
+	uint32_t gen[3];		/* content generation of every lane */
 } fl2k_xfer_info_t;
 
 struct fl2k_dev {
@@ -81,6 +202,7 @@ struct fl2k_dev {
 	uint32_t xfer_buf_len;
 	struct libusb_transfer **xfer;
 	unsigned char **xfer_buf;
+	unsigned char *idle_buf;	/* zeroed, sent while paused */
 
 	fl2k_xfer_info_t *xfer_info;
 
@@ -91,19 +213,44 @@ struct fl2k_dev {
 
 	int use_zerocopy;
 	int terminate;
+	int drain;			/* stop calling back, send what is left */
+	int drain_done;			/* sample worker has stopped */
+	int drained;			/* all transfers were sent */
+	int paused;
 
 	/* thread related */
 	pthread_t usb_worker_thread;
-	pthread_t sample_worker_thread;
+	fl2k_worker_t *workers;		/* sample workers */
+	uint32_t worker_num;
+	uint32_t workers_running;
 	pthread_mutex_t buf_mutex;
 	pthread_cond_t buf_cond;
+	pthread_mutex_t i2c_mutex;
+
+	uint64_t next_seq;		/* handed out to the next sample worker */
+	uint64_t submit_seq;		/* next transfer to be submitted */
 
 	double rate; /* Hz */
+	fl2k_rate_change_t rate_queue[FL2K_RATE_QUEUE];
+	unsigned int rate_head, rate_tail;
+	uint32_t prefill_ms;
+
+	/* low watermark of the filled transfers, changed while streaming */
+	pthread_mutex_t wm_mutex;
+	uint32_t wm_level;
+	fl2k_watermark_cb_t wm_cb;
+	void *wm_ctx;
+	int wm_low;
 
 	/* status */
 	int dev_lost;
 	int driver_active;
 	uint32_t underflow_cnt;
+
+	fl2k_stats_t stats;
+	fl2k_trace_t *trace;
+	fl2k_metrics_t *metrics;
+	fl2k_spectrum_t *spectrum;
 };
 
 typedef struct fl2k_dongle {
@@ -118,9 +265,14 @@ static fl2k_dongle_t known_devices[] = {
 
 #define DEFAULT_BUF_NUMBER	4
 
+#define DEFAULT_TRACE_EVENTS	65536
+#define DEFAULT_METRICS_INTERVAL	1000
+#define DEFAULT_SPECTRUM_FFT_LEN	1024
+
 #define CTRL_IN		(LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN)
 #define CTRL_OUT	(LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT)
 #define CTRL_TIMEOUT	300
+#define I2C_TIMEOUT	100
 #define BULK_TIMEOUT	0
 
 /*int fl2k_resample_to_freq_old(fl2k_data_info_t *data_info, uint32_t orate0,char color)
@@ -361,14 +513,16 @@ static double fl2k_reg_to_freq(uint32_t reg)
 	return sample_clock;
 }
 
-int fl2k_set_sample_rate(fl2k_dev_t *dev, uint32_t target_freq)
+/* Find the PLL setting closest to target_freq. The clock is linear in
+ * frac for every multiplier and divider, so only the two fractional
+ * values around the exact solution need to be checked. The result is the
+ * same as when trying every frac, first match wins. */
+static uint32_t fl2k_calc_pll_reg(uint32_t target_freq)
 {
-	double sample_clock, error, last_error = 1e20f;
+	double base, step, error, last_error = 1e20f;
 	uint32_t reg = 0, result_reg = 0;
 	uint8_t div, mult, frac, out_div;
-
-	if (!dev)
-		return FL2K_ERROR_INVALID_PARAM;
+	int cand[2], i;
 
 	/* Output divider (accepts value 1-15)
 	 * works, but adds lots of phase noise, so do not use it */
@@ -378,22 +532,47 @@ int fl2k_set_sample_rate(fl2k_dev_t *dev, uint32_t target_freq)
 	 * noise. Prefer multiplier 6 and 5 */
 	for (mult = 6; mult >= 3; mult--) {
 		for (div = 63; div > 1; div--) {
-			for (frac = 1; frac <= 15; frac++) {
-				reg =  (mult << 20) | (frac << 16) |
-				       (0x60 << 8) | (out_div << 8) | div;
+			reg = (mult << 20) | (0x60 << 8) | (out_div << 8) | div;
+			base = fl2k_reg_to_freq(reg);
+			step = fl2k_reg_to_freq(reg | (1 << 16)) - base;
+
+			cand[0] = (int)floor(((double)target_freq - base) / step);
+			cand[1] = cand[0] + 1;
+
+			for (i = 0; i < 2; i++) {
+				if (cand[i] < 1)
+					cand[i] = 1;
+				else if (cand[i] > 15)
+					cand[i] = 15;
+			}
 
-				sample_clock = fl2k_reg_to_freq(reg);
-				error = sample_clock - (double)target_freq;
+			for (i = 0; i < 2; i++) {
+				frac = cand[i];
+				error = fl2k_reg_to_freq(reg | (frac << 16)) -
+					(double)target_freq;
 
 				/* Keep closest match */
 				if (fabs(error) < last_error) {
-					result_reg = reg;
+					result_reg = reg | (frac << 16);
 					last_error = fabs(error);
 				}
 			}
 		}
 	}
 
+	return result_reg;
+}
+
+int fl2k_set_sample_rate(fl2k_dev_t *dev, uint32_t target_freq)
+{
+	double sample_clock, error;
+	uint32_t result_reg;
+
+	if (!dev)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	result_reg = fl2k_calc_pll_reg(target_freq);
+
 	sample_clock = fl2k_reg_to_freq(result_reg);
 	error = sample_clock - (double)target_freq;
 	dev->rate = sample_clock;
@@ -410,6 +589,82 @@ int fl2k_set_sample_rate(fl2k_dev_t *dev, uint32_t target_freq)
 	return fl2k_write_reg(dev, 0x802c, result_reg);
 }
 
+static void LIBUSB_CALL _libusb_rate_callback(struct libusb_transfer *xfer)
+{
+	fl2k_dev_t *dev = (fl2k_dev_t *)xfer->user_data;
+
+	if (LIBUSB_TRANSFER_COMPLETED == xfer->status)
+		memcpy(&dev->rate, xfer->buffer + LIBUSB_CONTROL_SETUP_SIZE + 8,
+		       sizeof(double));
+	else
+		fprintf(stderr, "Failed to change sample rate: %d\n",
+				xfer->status);
+
+	libusb_free_transfer(xfer);
+}
+
+int fl2k_queue_sample_rate(fl2k_dev_t *dev, uint32_t target_freq,
+			   uint64_t seq)
+{
+	struct libusb_transfer *xfer;
+	fl2k_rate_change_t *change;
+	unsigned char *buf;
+	uint32_t reg;
+	double rate;
+	unsigned int tail;
+
+	if (!dev)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	if (FL2K_RUNNING != dev->async_status)
+		return fl2k_set_sample_rate(dev, target_freq);
+
+	reg = fl2k_calc_pll_reg(target_freq);
+	rate = fl2k_reg_to_freq(reg);
+
+	/* setup packet, register value, and the resulting rate behind it */
+	xfer = libusb_alloc_transfer(0);
+	buf = malloc(LIBUSB_CONTROL_SETUP_SIZE + 8 + sizeof(double));
+	if (!xfer || !buf) {
+		libusb_free_transfer(xfer);
+		free(buf);
+		return FL2K_ERROR_NO_MEM;
+	}
+
+	libusb_fill_control_setup(buf, CTRL_OUT, 0x41, 0, 0x802c, 4);
+	buf[LIBUSB_CONTROL_SETUP_SIZE] = reg & 0xff;
+	buf[LIBUSB_CONTROL_SETUP_SIZE + 1] = (reg >> 8) & 0xff;
+	buf[LIBUSB_CONTROL_SETUP_SIZE + 2] = (reg >> 16) & 0xff;
+	buf[LIBUSB_CONTROL_SETUP_SIZE + 3] = (reg >> 24) & 0xff;
+	memcpy(buf + LIBUSB_CONTROL_SETUP_SIZE + 8, &rate, sizeof(double));
+
+	libusb_fill_control_transfer(xfer, dev->devh, buf,
+				     _libusb_rate_callback, dev, CTRL_TIMEOUT);
+	xfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+	pthread_mutex_lock(&dev->buf_mutex);
+
+	tail = (dev->rate_tail + 1) % FL2K_RATE_QUEUE;
+	if (tail == dev->rate_head) {
+		pthread_mutex_unlock(&dev->buf_mutex);
+		libusb_free_transfer(xfer);
+		return FL2K_ERROR_BUSY;
+	}
+
+	change = &dev->rate_queue[dev->rate_tail];
+	change->seq = seq;
+	change->xfer = xfer;
+	dev->rate_tail = tail;
+
+	pthread_mutex_unlock(&dev->buf_mutex);
+
+	if (fabs(rate - (double)target_freq) > 1)
+		fprintf(stderr, "Requested sample rate %d not possible, using"
+				" %f\n", target_freq, rate);
+
+	return 0;
+}
+
 uint32_t fl2k_get_sample_rate(fl2k_dev_t *dev)
 {
 	if (!dev)
@@ -418,491 +673,1765 @@ uint32_t fl2k_get_sample_rate(fl2k_dev_t *dev)
 	return (uint32_t)dev->rate;
 }
 
-static fl2k_dongle_t *find_known_device(uint16_t vid, uint16_t pid)
+static uint64_t fl2k_now_ns(void)
 {
-	unsigned int i;
-	fl2k_dongle_t *device = NULL;
+#ifdef _WIN32
+	LARGE_INTEGER freq, cnt;
 
-	for (i = 0; i < sizeof(known_devices)/sizeof(fl2k_dongle_t); i++ ) {
-		if (known_devices[i].vid == vid && known_devices[i].pid == pid) {
-			device = &known_devices[i];
-			break;
-		}
-	}
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&cnt);
 
-	return device;
-}
+	return (uint64_t)((double)cnt.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+	struct timespec ts;
 
-uint32_t fl2k_get_device_count(void)
-{
-	int i,r;
-	libusb_context *ctx;
-	libusb_device **list;
-	uint32_t device_count = 0;
-	struct libusb_device_descriptor dd;
-	ssize_t cnt;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	r = libusb_init(&ctx);
-	if (r < 0)
-		return 0;
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
 
-	cnt = libusb_get_device_list(ctx, &list);
+/* Event trace of the TX pipeline
+ *
+ * Every library thread writes into its own ring of fixed size, so
+ * recording an event is a timestamp and a few stores. The rings can be
+ * dumped in the Chrome trace event format, which can be opened with
+ * chrome://tracing or https://ui.perfetto.dev
+ */
+static const char *fl2k_trace_names[] = {
+	[FL2K_TRACE_CALLBACK]	= "callback",
+	[FL2K_TRACE_CONVERT]	= "convert",
+	[FL2K_TRACE_SUBMIT]	= "submit",
+	[FL2K_TRACE_COMPLETE]	= "complete",
+	[FL2K_TRACE_UNDERFLOW]	= "underflow",
+	[FL2K_TRACE_WAIT]	= "wait",
+};
 
-	for (i = 0; i < cnt; i++) {
-		libusb_get_device_descriptor(list[i], &dd);
 
-		if (find_known_device(dd.idVendor, dd.idProduct))
-			device_count++;
-	}
+static inline void fl2k_trace(fl2k_dev_t *dev, unsigned int ring,
+			      uint16_t type, char phase, uint32_t arg)
+{
+	fl2k_trace_ring_t *r;
+	fl2k_trace_event_t *ev;
+	uint32_t slot;
 
-	libusb_free_device_list(list, 1);
+	if (!dev->trace)
+		return;
 
-	libusb_exit(ctx);
+	r = &dev->trace->ring[ring];
+	slot = fl2k_atomic_add(&r->head, 1) & r->mask;
+	if (slot == r->mask)
+		r->wrapped = 1;
 
-	return device_count;
+	ev = &r->ev[slot];
+	ev->ts = fl2k_now_ns();
+	ev->arg = arg;
+	ev->type = type;
+	ev->phase = phase;
 }
 
-const char *fl2k_get_device_name(uint32_t index)
+static int fl2k_trace_write(fl2k_trace_t *trace, const char *path)
 {
-	int i,r;
-	libusb_context *ctx;
-	libusb_device **list;
-	struct libusb_device_descriptor dd;
-	fl2k_dongle_t *device = NULL;
-	uint32_t device_count = 0;
-	ssize_t cnt;
+	FILE *f;
+	uint32_t i, head, start;
+	unsigned int ring;
+	fl2k_trace_event_t ev;
+	char name[32];
+	int pid = 0, first = 1, wrapped;
+
+	f = fopen(path, "w");
+	if (!f)
+		return FL2K_ERROR_NOT_FOUND;
 
-	r = libusb_init(&ctx);
-	if (r < 0)
-		return "";
+#ifndef _WIN32
+	pid = getpid();
+#endif
 
-	cnt = libusb_get_device_list(ctx, &list);
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
 
-	for (i = 0; i < cnt; i++) {
-		libusb_get_device_descriptor(list[i], &dd);
+	for (ring = 0; ring < FL2K_TRACE_RINGS; ring++) {
+		head = trace->ring[ring].head;
+		wrapped = trace->ring[ring].wrapped;
 
-		device = find_known_device(dd.idVendor, dd.idProduct);
+		/* only list the producer threads that were used */
+		if (ring > FL2K_RING_SAMPLE && !head && !wrapped)
+			continue;
 
-		if (device) {
-			device_count++;
+		if (ring == FL2K_RING_USB)
+			snprintf(name, sizeof(name), "usb worker");
+		else if (ring == FL2K_RING_SAMPLE)
+			snprintf(name, sizeof(name), "sample worker");
+		else
+			snprintf(name, sizeof(name), "sample worker %u",
+				 ring - FL2K_RING_SAMPLE);
 
-			if (index == device_count - 1)
-				break;
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+			"\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+			first ? "" : ",\n", pid, ring, name);
+		first = 0;
+
+		/* head keeps counting past 2^32, so only the wrap flag
+		 * tells whether the oldest event is still in slot 0 */
+		start = wrapped ? head - trace->events : 0;
+
+		for (i = start; i != head; i++) {
+			ev = trace->ring[ring].ev[i & trace->ring[ring].mask];
+
+			/* slot is being written right now */
+			if (!ev.phase)
+				continue;
+
+			fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+				"\"pid\":%d,\"tid\":%u%s,\"args\":{\"seq\":%u}}",
+				fl2k_trace_names[ev.type], ev.phase,
+				(ev.ts - trace->t0) / 1000.0, pid, ring,
+				ev.phase == 'i' ? ",\"s\":\"t\"" : "", ev.arg);
 		}
 	}
 
-	libusb_free_device_list(list, 1);
+	fprintf(f, "\n]}\n");
+	fclose(f);
+
+	return 0;
+}
 
-	libusb_exit(ctx);
+static void *fl2k_trace_dump_worker(void *arg)
+{
+	fl2k_trace_t *trace = (fl2k_trace_t *)arg;
 
-	if (device)
-		return device->name;
+	if (fl2k_trace_write(trace, trace->path) < 0)
+		fprintf(stderr, "Failed to write trace to %s\n", trace->path);
 	else
-		return "";
+		fprintf(stderr, "Trace written to %s\n", trace->path);
+
+	trace->dump_busy = 0;
+	pthread_exit(NULL);
 }
 
-int fl2k_open(fl2k_dev_t **out_dev, uint32_t index)
+/* called from the USB worker, never writes the file itself */
+static void fl2k_trace_poll_dump(fl2k_dev_t *dev)
 {
-	int r;
-	int i;
-	libusb_device **list;
-	fl2k_dev_t *dev = NULL;
-	libusb_device *device = NULL;
-	uint32_t device_count = 0;
-	struct libusb_device_descriptor dd;
-	uint8_t reg;
-	ssize_t cnt;
+	fl2k_trace_t *trace = dev->trace;
+	pthread_attr_t attr;
+	pthread_t thread;
 
-	dev = malloc(sizeof(fl2k_dev_t));
-	if (NULL == dev)
-		return -ENOMEM;
+	if (!trace || !trace->dump_req || trace->dump_busy || !trace->path)
+		return;
 
-	memset(dev, 0, sizeof(fl2k_dev_t));
+	trace->dump_req = 0;
+	trace->dump_busy = 1;
 
-	r = libusb_init(&dev->ctx);
-	if(r < 0){
-		free(dev);
-		return -1;
-	}
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, fl2k_trace_dump_worker, trace))
+		trace->dump_busy = 0;
+	pthread_attr_destroy(&attr);
+}
 
-#if LIBUSB_API_VERSION >= 0x01000106
-	libusb_set_option(dev->ctx, LIBUSB_OPTION_LOG_LEVEL, 3);
-#else
-	libusb_set_debug(dev->ctx, 3);
-#endif
+static void fl2k_trace_free(fl2k_trace_t *trace)
+{
+	unsigned int ring;
 
-	dev->dev_lost = 1;
+	if (!trace)
+		return;
+
+	/* a requested dump might still be running */
+	while (trace->dump_busy)
+		sleep_ms(10);
 
-	cnt = libusb_get_device_list(dev->ctx, &list);
+	for (ring = 0; ring < FL2K_TRACE_RINGS; ring++)
+		free(trace->ring[ring].ev);
 
-	for (i = 0; i < cnt; i++) {
-		device = list[i];
+	free(trace->path);
+	free(trace);
+}
 
-		libusb_get_device_descriptor(list[i], &dd);
+/* Publishing of status text, either by atomically replacing a file
+ * (e.g. for the node_exporter textfile collector), or by answering
+ * every connection to a Unix domain socket ("unix:/path") */
+static int fl2k_publisher_open(fl2k_publisher_t *pub, const char *path)
+{
+	memset(pub, 0, sizeof(fl2k_publisher_t));
+	pub->fd = -1;
 
-		if (find_known_device(dd.idVendor, dd.idProduct)) {
-			device_count++;
+	if (!strncmp(path, "unix:", 5)) {
+#ifndef _WIN32
+		struct sockaddr_un addr;
+
+		path += 5;
+		if (strlen(path) >= sizeof(addr.sun_path))
+			return FL2K_ERROR_INVALID_PARAM;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, path);
+
+		pub->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (pub->fd < 0)
+			return FL2K_ERROR_NOT_FOUND;
+
+		unlink(path);
+		if (bind(pub->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		    listen(pub->fd, 4) < 0) {
+			fprintf(stderr, "Failed to listen on %s\n", path);
+			close(pub->fd);
+			pub->fd = -1;
+			return FL2K_ERROR_NOT_FOUND;
 		}
 
-		if (index == device_count - 1)
-			break;
-
-		device = NULL;
+		fcntl(pub->fd, F_SETFL, fcntl(pub->fd, F_GETFL) | O_NONBLOCK);
+#else
+		return FL2K_ERROR_INVALID_PARAM;
+#endif
 	}
 
-	if (!device) {
-		r = -1;
-		goto err;
-	}
+	pub->path = strdup(path);
 
-	r = libusb_open(device, &dev->devh);
-	libusb_free_device_list(list, 1);
-	if (r < 0) {
-		fprintf(stderr, "usb_open error %d\n", r);
-		if(r == LIBUSB_ERROR_ACCESS)
-			fprintf(stderr, "Please fix the device permissions, e.g. "
-			"by installing the udev rules file\n");
-		goto err;
-	}
+	return pub->path ? 0 : FL2K_ERROR_NO_MEM;
+}
 
-	/* If the adapter has an SPI flash for the Windows driver, we
-	 * need to detach the USB mass storage driver first in order to
-	 * open the device */
-	if (libusb_kernel_driver_active(dev->devh, 3) == 1) {
-		fprintf(stderr, "Kernel mass storage driver is attached, "
-				"detaching driver. This may take more than"
-				" 10 seconds!\n");
-		r = libusb_detach_kernel_driver(dev->devh, 3);
-		if (r < 0) {
-			fprintf(stderr, "Failed to detach mass storage "
-					"driver: %d\n", r);
-			goto err;
-		}
+static void fl2k_publisher_close(fl2k_publisher_t *pub)
+{
+#ifndef _WIN32
+	if (pub->fd >= 0) {
+		close(pub->fd);
+		unlink(pub->path);
 	}
+#endif
+	free(pub->path);
+	pub->path = NULL;
+}
 
-	r = libusb_claim_interface(dev->devh, 0);
-	if (r < 0) {
-		fprintf(stderr, "usb_claim_interface 0 error %d\n", r);
-		goto err;
+/* Wait up to timeout_ms for something to do. Returns 1 if the text
+ * should be published now: always for files, on a pending connection
+ * for sockets. */
+static int fl2k_publisher_wait(fl2k_publisher_t *pub, uint32_t timeout_ms)
+{
+#ifndef _WIN32
+	struct pollfd pfd;
+
+	if (pub->fd >= 0) {
+		pfd.fd = pub->fd;
+		pfd.events = POLLIN;
+		return poll(&pfd, 1, timeout_ms) > 0;
 	}
+#endif
+	sleep_ms(timeout_ms);
 
-	r = libusb_set_interface_alt_setting(dev->devh, 0, 1);
-	if (r < 0) {
-		fprintf(stderr, "Failed to switch interface 0 to "
-				"altsetting 1, trying to use interface 1\n");
+	return 1;
+}
 
-		r = libusb_claim_interface(dev->devh, 1);
-		if (r < 0) {
-			fprintf(stderr, "Could not claim interface 1: %d\n", r);
+static void fl2k_publisher_write(fl2k_publisher_t *pub, const char *text,
+				 const char *content_type)
+{
+	char tmp[4096];
+	FILE *f;
+#ifndef _WIN32
+	struct pollfd pfd;
+	char hdr[512];
+	int fd, len;
+
+	if (pub->fd >= 0) {
+		while ((fd = accept(pub->fd, NULL, NULL)) >= 0) {
+			/* answer like a HTTP/1.0 server, so curl --unix-socket
+			 * and Prometheus proxies can scrape it. Consume the
+			 * request first, closing with unread data resets the
+			 * connection. */
+			pfd.fd = fd;
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, 100) > 0)
+				len = read(fd, hdr, sizeof(hdr));
+
+			len = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+				       "Content-Type: %s\r\n\r\n", content_type);
+			if (send(fd, hdr, len, MSG_NOSIGNAL) == len)
+				len = send(fd, text, strlen(text), MSG_NOSIGNAL);
+			close(fd);
 		}
+		return;
 	}
+#endif
+	snprintf(tmp, sizeof(tmp), "%s.tmp", pub->path);
 
-	r = fl2k_init_device(dev);
-	if (r < 0)
-		goto err;
+	f = fopen(tmp, "w");
+	if (!f)
+		return;
 
-	dev->dev_lost = 0;
+	fputs(text, f);
+	fclose(f);
 
-found:
-	*out_dev = dev;
-	fprintf(stderr, "Opening device %d\n", index);
-	return 0;
-err:
-	if (dev) {
-		if (dev->ctx)
-			libusb_exit(dev->ctx);
+#ifdef _WIN32
+	remove(pub->path);
+#endif
+	rename(tmp, pub->path);
+}
 
-		free(dev);
-	}
+/* Prometheus metrics, rendered by a thread of its own from counters
+ * that the TX threads only ever increment */
+static const double fl2k_lat_bounds[FL2K_LAT_BUCKETS - 1] = {
+	0.0001, 0.0005, 0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1
+};
 
-	return r;
+static void fl2k_stats_callback(fl2k_dev_t *dev, uint64_t ns)
+{
+	unsigned int i;
+
+	for (i = 0; i < FL2K_LAT_BUCKETS - 1; i++)
+		if (ns <= fl2k_lat_bounds[i] * 1e9)
+			break;
+
+	/* called by every sample worker when there are several */
+	fl2k_atomic_add(&dev->stats.cb_hist[i], 1);
+	fl2k_atomic_add(&dev->stats.cb_ns_sum, ns);
+	fl2k_atomic_add(&dev->stats.callbacks, 1);
 }
 
-int fl2k_close(fl2k_dev_t *dev)
+static int fl2k_metrics_render(fl2k_dev_t *dev, fl2k_metrics_t *m,
+			       char *buf, size_t size)
 {
-	if (!dev)
-		return FL2K_ERROR_INVALID_PARAM;
-
-	if(!dev->dev_lost) {
-		/* block until all async operations have been completed (if any) */
-		while (FL2K_INACTIVE != dev->async_status)
-			sleep_ms(100);
+	fl2k_stats_t *st = &dev->stats;
+	uint64_t cnt = st->xfers_completed, ns = st->last_complete_ns;
+	uint64_t cumulative = 0;
+	size_t len = 0;
+	unsigned int i;
 
-		fl2k_deinit_device(dev);
+	/* measure the actual sample rate against the host clock over
+	 * windows of at least 10 seconds */
+	if (cnt < m->last_cnt)
+		m->last_cnt = 0;
+
+	if (!m->last_cnt) {
+		m->last_cnt = cnt;
+		m->last_ns = ns;
+	} else if (ns - m->last_ns >= 10000000000ULL && dev->rate > 0) {
+		m->measured_rate = (double)(cnt - m->last_cnt) * FL2K_BUF_LEN *
+				   1e9 / (double)(ns - m->last_ns);
+		m->ppm = (m->measured_rate / dev->rate - 1.0) * 1e6;
+		m->last_cnt = cnt;
+		m->last_ns = ns;
 	}
 
-	libusb_release_interface(dev->devh, 0);
-	libusb_close(dev->devh);
-	libusb_exit(dev->ctx);
+#define OUT(...) \
+	do { \
+		if (len < size) \
+			len += snprintf(buf + len, size - len, __VA_ARGS__); \
+	} while (0)
+
+	OUT("# HELP fl2k_sample_rate_hz Configured sample rate\n"
+	    "# TYPE fl2k_sample_rate_hz gauge\n"
+	    "fl2k_sample_rate_hz %.3f\n", dev->rate);
+	OUT("# HELP fl2k_measured_sample_rate_hz Sample rate measured "
+	    "against the host clock\n"
+	    "# TYPE fl2k_measured_sample_rate_hz gauge\n"
+	    "fl2k_measured_sample_rate_hz %.3f\n", m->measured_rate);
+	OUT("# HELP fl2k_measured_ppm Deviation of the measured from the "
+	    "configured sample rate\n"
+	    "# TYPE fl2k_measured_ppm gauge\n"
+	    "fl2k_measured_ppm %.3f\n", m->ppm);
+	OUT("# HELP fl2k_streaming Transmission is running\n"
+	    "# TYPE fl2k_streaming gauge\n"
+	    "fl2k_streaming %d\n", FL2K_RUNNING == dev->async_status);
+	OUT("# HELP fl2k_zerocopy Transfers use zero-copy kernel buffers\n"
+	    "# TYPE fl2k_zerocopy gauge\n"
+	    "fl2k_zerocopy %d\n", dev->use_zerocopy);
+	OUT("# HELP fl2k_queue_depth Filled transfers waiting for submission\n"
+	    "# TYPE fl2k_queue_depth gauge\n"
+	    "fl2k_queue_depth %u\n", st->queue_depth);
+	OUT("# HELP fl2k_underflows_total Transfers resubmitted without new "
+	    "data\n"
+	    "# TYPE fl2k_underflows_total counter\n"
+	    "fl2k_underflows_total %llu\n",
+	    (unsigned long long)st->underflows);
+	OUT("# HELP fl2k_transfers_total Completed transfers\n"
+	    "# TYPE fl2k_transfers_total counter\n"
+	    "fl2k_transfers_total %llu\n", (unsigned long long)cnt);
+	OUT("# HELP fl2k_device_lost_total Device lost events\n"
+	    "# TYPE fl2k_device_lost_total counter\n"
+	    "fl2k_device_lost_total %llu\n",
+	    (unsigned long long)st->dev_lost);
+	OUT("# HELP fl2k_callback_seconds Duration of the sample callback\n"
+	    "# TYPE fl2k_callback_seconds histogram\n");
+
+	for (i = 0; i < FL2K_LAT_BUCKETS; i++) {
+		cumulative += st->cb_hist[i];
+
+		if (i < FL2K_LAT_BUCKETS - 1)
+			OUT("fl2k_callback_seconds_bucket{le=\"%g\"} %llu\n",
+			    fl2k_lat_bounds[i], (unsigned long long)cumulative);
+		else
+			OUT("fl2k_callback_seconds_bucket{le=\"+Inf\"} %llu\n",
+			    (unsigned long long)cumulative);
+	}
 
-	free(dev);
+	OUT("fl2k_callback_seconds_sum %.9f\n"
+	    "fl2k_callback_seconds_count %llu\n",
+	    st->cb_ns_sum / 1e9, (unsigned long long)cumulative);
+#undef OUT
 
-	return 0;
+	return len < size ? 0 : FL2K_ERROR_NO_MEM;
 }
 
-static struct libusb_transfer *fl2k_get_next_xfer(fl2k_dev_t *dev,
-					          fl2k_buf_state_t state)
+static void *fl2k_metrics_worker(void *arg)
 {
-	unsigned int i;
-	int next_buf = -1;
-	uint64_t next_seq = 0;
-	fl2k_xfer_info_t *xfer_info;
+	fl2k_dev_t *dev = (fl2k_dev_t *)arg;
+	fl2k_metrics_t *m = dev->metrics;
+	char buf[4096];
 
-	for (i = 0; i < dev->xfer_buf_num; i++) {
-		xfer_info = (fl2k_xfer_info_t *)dev->xfer[i]->user_data;
-		if (!xfer_info)
+	while (!m->terminate) {
+		if (!fl2k_publisher_wait(&m->pub, m->interval_ms))
 			continue;
 
-		if (xfer_info->state == state) {
-			if (state == BUF_EMPTY) {
-				return dev->xfer[i];
-			} else if ((xfer_info->seq < next_seq) || next_buf < 0) {
-				next_seq = xfer_info->seq;
-				next_buf = i;
-			}
-		}
+		if (m->terminate)
+			break;
+
+		fl2k_metrics_render(dev, m, buf, sizeof(buf));
+		fl2k_publisher_write(&m->pub, buf,
+				     "text/plain; version=0.0.4");
 	}
 
-	if ((state == BUF_FILLED) && (next_buf >= 0))
-		return dev->xfer[next_buf];
-	else
-		return NULL;
+	pthread_exit(NULL);
 }
 
-static void LIBUSB_CALL _libusb_callback(struct libusb_transfer *xfer)
-{
-	fl2k_xfer_info_t *xfer_info = (fl2k_xfer_info_t *)xfer->user_data;
-	fl2k_xfer_info_t *next_xfer_info;
-	fl2k_dev_t *dev = (fl2k_dev_t *)xfer_info->dev;
-	struct libusb_transfer *next_xfer = NULL;
-	int r = 0;
+/* Spectrum monitor
+ *
+ * On request of the monitor thread, the next converted transfer is
+ * copied in part by whichever sample worker gets the snapshot lock
+ * without waiting. The monitor runs at idle priority, undoes the
+ * interleaving of the DAC lanes and publishes the spectra of the three
+ * channels as JSON.
+ */
 
-	if (LIBUSB_TRANSFER_COMPLETED == xfer->status) {
-		/* resubmit transfer */
-		if (FL2K_RUNNING == dev->async_status) {
-			/* get next transfer */
-			next_xfer = fl2k_get_next_xfer(dev, BUF_FILLED);
+#if defined(__linux__) && !defined(SCHED_IDLE)
+#define SCHED_IDLE	5
+#endif
 
-			if (next_xfer) {
-				next_xfer_info = (fl2k_xfer_info_t *) next_xfer->user_data;
+/* position of the 8 samples of every channel within 24 output bytes,
+ * see fl2k_interleave_c() */
+static const uint8_t fl2k_lane_pos[3][8] = {
+	{  6,  1, 12, 15, 10, 21, 16, 19 },
+	{  5,  0,  3, 14,  9, 20, 23, 18 },
+	{  4,  7,  2, 13,  8, 11, 22, 17 },
+};
 
-				/* Submit next filled transfer */
-				next_xfer_info->state = BUF_SUBMITTED;
-				r = libusb_submit_transfer(next_xfer);
-				xfer_info->state = BUF_EMPTY;
-				pthread_cond_signal(&dev->buf_cond);
-			} else {
-				/* We need to re-submit the transfer
-				 * in any case, as otherwise the device
-				 * stops to output data and hangs
-				 * (happens only in the hacked 'gapless'
-				 * mode without HSYNC and VSYNC)  */
-				r = libusb_submit_transfer(xfer);
-				pthread_cond_signal(&dev->buf_cond);
-				dev->underflow_cnt++;
-			}
+/* called by the sample workers, never waits for the monitor */
+static void fl2k_spectrum_capture(fl2k_spectrum_t *sp, const uint8_t *buf,
+				  uint64_t seq)
+{
+	if (pthread_mutex_trylock(&sp->lock)) {
+		fl2k_atomic_add(&sp->dropped, 1);
+		return;
+	}
+
+	if (sp->want) {
+		memcpy(sp->snap, buf, sp->fft_len * 3);
+		sp->snap_seq = seq;
+		sp->want = 0;
+		sp->ready = 1;
+	}
+
+	pthread_mutex_unlock(&sp->lock);
+}
+
+/* in-place radix-2 FFT, n is a power of two */
+static void fl2k_fft(float *re, float *im, uint32_t n)
+{
+	uint32_t i, j, k, bit, half, len;
+	double wr, wi, cr, ci, t;
+	float ur, ui, vr, vi, tmp;
+
+	for (i = 1, j = 0; i < n; i++) {
+		for (bit = n >> 1; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+
+		if (i < j) {
+			tmp = re[i]; re[i] = re[j]; re[j] = tmp;
+			tmp = im[i]; im[i] = im[j]; im[j] = tmp;
 		}
 	}
 
-	if (((LIBUSB_TRANSFER_CANCELLED != xfer->status) &&
-	     (LIBUSB_TRANSFER_COMPLETED != xfer->status)) ||
-	     (r == LIBUSB_ERROR_NO_DEVICE)) {
-			dev->dev_lost = 1;
-			fl2k_stop_tx(dev);
-			pthread_cond_signal(&dev->buf_cond);
-			fprintf(stderr, "cb transfer status: %d, submit "
-				"transfer %d, canceling...\n", xfer->status, r);
+	for (len = 2; len <= n; len <<= 1) {
+		half = len >> 1;
+		wr = cos(-2.0 * M_PI / len);
+		wi = sin(-2.0 * M_PI / len);
+
+		for (i = 0; i < n; i += len) {
+			cr = 1.0;
+			ci = 0.0;
+
+			for (k = 0; k < half; k++) {
+				ur = re[i + k];
+				ui = im[i + k];
+				vr = re[i + k + half] * cr - im[i + k + half] * ci;
+				vi = re[i + k + half] * ci + im[i + k + half] * cr;
+
+				re[i + k] = ur + vr;
+				im[i + k] = ui + vi;
+				re[i + k + half] = ur - vr;
+				im[i + k + half] = ui - vi;
+
+				t = cr * wr - ci * wi;
+				ci = cr * wi + ci * wr;
+				cr = t;
+			}
+		}
 	}
 }
 
-static int fl2k_alloc_submit_transfers(fl2k_dev_t *dev)
+static void fl2k_spectrum_render(fl2k_dev_t *dev, fl2k_spectrum_t *sp)
 {
-	unsigned int i;
-	int r = 0;
-	const char *incr_usbfs = "Please increase your allowed usbfs buffer"
-				 " size with the following command:\n"
-				 "echo 0 > /sys/module/usbcore/parameters/"
-				 "usbfs_memory_mb\n";
+	static const char *names[3] = { "r", "g", "b" };
+	uint32_t n = sp->fft_len, i, c, clip_lo, clip_hi;
+	float *re = sp->re, *im = sp->im;
+	size_t len = 0, size = sp->out_size;
+	char *buf = sp->out;
+	double mag, norm;
+	uint8_t s;
+
+#define OUT(...) \
+	do { \
+		if (len < size) \
+			len += snprintf(buf + len, size - len, __VA_ARGS__); \
+	} while (0)
+
+	OUT("{\"seq\":%llu,\"sample_rate\":%.3f,\"fft_len\":%u,"
+	    "\"snapshots\":%llu,\"dropped\":%llu,\"channels\":{",
+	    (unsigned long long)sp->snap_seq, dev->rate, n,
+	    (unsigned long long)sp->snapshots,
+	    (unsigned long long)sp->dropped);
+
+	/* a full scale sine ends up in a bin with n/4 after the window */
+	norm = 4.0 / n;
+
+	for (c = 0; c < 3; c++) {
+		clip_lo = clip_hi = 0;
+
+		for (i = 0; i < n; i++) {
+			s = sp->snap[(i / 8) * 24 + fl2k_lane_pos[c][i % 8]];
+			clip_lo += (s == 0);
+			clip_hi += (s == 255);
+
+			re[i] = (s - 127.5f) / 127.5f * sp->window[i];
+			im[i] = 0.0f;
+		}
 
-	if (!dev)
-		return FL2K_ERROR_INVALID_PARAM;
+		fl2k_fft(re, im, n);
 
-	dev->xfer = malloc(dev->xfer_buf_num * sizeof(struct libusb_transfer *));
+		OUT("%s\"%s\":{\"clip_low\":%u,\"clip_high\":%u,\"dbfs\":[",
+		    c ? "," : "", names[c], clip_lo, clip_hi);
 
-	for (i = 0; i < dev->xfer_buf_num; ++i)
-		dev->xfer[i] = libusb_alloc_transfer(0);
+		for (i = 0; i <= n / 2; i++) {
+			mag = sqrt(re[i] * re[i] + im[i] * im[i]) * norm;
+			OUT("%s%.1f", i ? "," : "",
+			    mag > 1e-10 ? 20.0 * log10(mag) : -200.0);
+		}
 
-	dev->xfer_buf = malloc(dev->xfer_buf_num * sizeof(unsigned char *));
-	memset(dev->xfer_buf, 0, dev->xfer_buf_num * sizeof(unsigned char *));
+		OUT("]}");
+	}
 
-	dev->xfer_info = malloc(dev->xfer_buf_num * sizeof(fl2k_xfer_info_t));
-	memset(dev->xfer_info, 0, dev->xfer_buf_num * sizeof(fl2k_xfer_info_t));
+	OUT("}}\n");
+#undef OUT
+}
 
-#if defined (__linux__) && LIBUSB_API_VERSION >= 0x01000105
-	fprintf(stderr, "Allocating %d zero-copy buffers\n", dev->xfer_buf_num);
+static void *fl2k_spectrum_worker(void *arg)
+{
+	fl2k_dev_t *dev = (fl2k_dev_t *)arg;
+	fl2k_spectrum_t *sp = dev->spectrum;
+	int ready;
+#if defined(__linux__)
+	struct sched_param param;
+
+	/* only use otherwise idle CPU time */
+	memset(&param, 0, sizeof(param));
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
 
-	dev->use_zerocopy = 1;
-	for (i = 0; i < dev->xfer_buf_num; ++i) {
-		dev->xfer_buf[i] = libusb_dev_mem_alloc(dev->devh, dev->xfer_buf_len);
+	sp->out[0] = '\0';
 
-		if (dev->xfer_buf[i]) {
-			/* Check if Kernel usbfs mmap() bug is present: if the
-			 * mapping is correct, the buffers point to memory that
-			 * was memset to 0 by the Kernel, otherwise, they point
-			 * to random memory. We check if the buffers are zeroed
-			 * and otherwise fall back to buffers in userspace.
-			 */
-			if (dev->xfer_buf[i][0] || memcmp(dev->xfer_buf[i],
-							  dev->xfer_buf[i] + 1,
-							  dev->xfer_buf_len - 1)) {
-				fprintf(stderr, "Detected Kernel usbfs mmap() "
-						"bug, falling back to buffers "
-						"in userspace\n");
-				dev->use_zerocopy = 0;
-				break;
-			}
-		} else {
-			fprintf(stderr, "Failed to allocate zero-copy "
-					"buffer for transfer %d\n%sFalling "
-					"back to buffers in userspace\n",
-					i, incr_usbfs);
-			dev->use_zerocopy = 0;
+	pthread_mutex_lock(&sp->lock);
+	sp->want = 1;
+	pthread_mutex_unlock(&sp->lock);
+
+	while (!sp->terminate) {
+		if (!fl2k_publisher_wait(&sp->pub, sp->interval_ms))
+			continue;
+
+		if (sp->terminate)
 			break;
-		}
-	}
 
-	/* zero-copy buffer allocation failed (partially or completely)
-	 * we need to free the buffers again if already allocated */
-	if (!dev->use_zerocopy) {
-		for (i = 0; i < dev->xfer_buf_num; ++i) {
-			if (dev->xfer_buf[i])
-				libusb_dev_mem_free(dev->devh,
-						    dev->xfer_buf[i],
-						    dev->xfer_buf_len);
-		}
-	}
-#endif
+		/* the snapshot is only touched by the workers while
+		 * requested, so it can be used without the lock */
+		pthread_mutex_lock(&sp->lock);
+		ready = sp->ready;
+		sp->ready = 0;
+		pthread_mutex_unlock(&sp->lock);
 
-	/* no zero-copy available, allocate buffers in userspace */
-	if (!dev->use_zerocopy) {
-		for (i = 0; i < dev->xfer_buf_num; ++i) {
-			dev->xfer_buf[i] = malloc(dev->xfer_buf_len);
+		if (ready) {
+			sp->snapshots++;
+			fl2k_spectrum_render(dev, sp);
 
-			if (!dev->xfer_buf[i])
-				return FL2K_ERROR_NO_MEM;
+			pthread_mutex_lock(&sp->lock);
+			sp->want = 1;
+			pthread_mutex_unlock(&sp->lock);
 		}
+
+		if (sp->out[0])
+			fl2k_publisher_write(&sp->pub, sp->out,
+					     "application/json");
 	}
 
-	/* fill transfers */
-	for (i = 0; i < dev->xfer_buf_num; ++i) {
-		libusb_fill_bulk_transfer(dev->xfer[i],
-					  dev->devh,
-					  0x01,
-					  dev->xfer_buf[i],
-					  dev->xfer_buf_len,
-					  _libusb_callback,
-					  &dev->xfer_info[i],
-					  0);
+	pthread_exit(NULL);
+}
 
-		dev->xfer_info[i].dev = dev;
-		dev->xfer_info[i].state = BUF_EMPTY;
+static void fl2k_spectrum_free(fl2k_dev_t *dev)
+{
+	fl2k_spectrum_t *sp = dev->spectrum;
 
-		/* if we allocate the memory through the Kernel, it is
-		 * already cleared */
-		if (!dev->use_zerocopy)
-			memset(dev->xfer_buf[i], 0, dev->xfer_buf_len);
-	}
+	dev->spectrum = NULL;
 
-	/* submit transfers */
-	for (i = 0; i < dev->xfer_num; ++i) {
-		r = libusb_submit_transfer(dev->xfer[i]);
-		dev->xfer_info[i].state = BUF_SUBMITTED;
+	sp->terminate = 1;
+	pthread_join(sp->thread, NULL);
+	fl2k_publisher_close(&sp->pub);
+	pthread_mutex_destroy(&sp->lock);
 
-		if (r < 0) {
-			fprintf(stderr, "Failed to submit transfer %i\n%s",
-					i, incr_usbfs);
+	free(sp->snap);
+	free(sp->window);
+	free(sp->re);
+	free(sp->im);
+	free(sp->out);
+	free(sp);
+}
+
+static fl2k_dongle_t *find_known_device(uint16_t vid, uint16_t pid)
+{
+	unsigned int i;
+	fl2k_dongle_t *device = NULL;
+
+	for (i = 0; i < sizeof(known_devices)/sizeof(fl2k_dongle_t); i++ ) {
+		if (known_devices[i].vid == vid && known_devices[i].pid == pid) {
+			device = &known_devices[i];
 			break;
 		}
 	}
 
+	return device;
+}
+
+/* Enumeration cache
+ *
+ * The known devices are enumerated on a libusb context that is kept for
+ * the lifetime of the process. If libusb supports hotplug, the cache is
+ * only rebuilt after an arrival or removal event, so repeated lookups
+ * by index, port path or serial don't walk the bus again. Pending events
+ * are handled with every lookup, or by the hotplug thread if the
+ * application registered a callback. Devices are opened from their cache
+ * entry, so the context is shared by all handles.
+ */
+#define FL2K_MAX_DEVICES	16
+#define FL2K_PATH_LEN		32
+#define FL2K_HOTPLUG_QUEUE	16
+
+typedef struct fl2k_cache_entry {
+	libusb_device *device;
+	fl2k_dongle_t *dongle;
+	char path[FL2K_PATH_LEN];
+	char serial[256];
+	int serial_read;
+} fl2k_cache_entry_t;
+
+static struct {
+	pthread_mutex_t lock;
+	libusb_context *ctx;
+	int valid;
+	volatile uint32_t events;	/* hotplug events, counted lock-free */
+	uint32_t events_seen;		/* when the cache was built */
+	int hotplug;
+	uint32_t count;
+	fl2k_cache_entry_t dev[FL2K_MAX_DEVICES];
+	fl2k_hotplug_cb_t cb;		/* only used by the hotplug thread */
+	void *cb_ctx;
+	volatile int thread_running;
+	pthread_t thread;
+
+	/* libusb reports hotplug events on any thread handling events on
+	 * the context, also the USB worker of a streaming device, so they
+	 * are queued here and delivered by the hotplug thread */
+	pthread_mutex_t ev_lock;
+	struct {
+		int arrived;
+		char path[FL2K_PATH_LEN];
+	} ev[FL2K_HOTPLUG_QUEUE];
+	uint32_t ev_head;
+	uint32_t ev_count;
+	int ev_queue;			/* set while a callback is registered */
+} fl2k_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.ev_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void fl2k_usb_path(libusb_device *device, char *path, size_t len)
+{
+#if LIBUSB_API_VERSION >= 0x01000102
+	uint8_t ports[7];
+	int i, n, pos;
+
+	pos = snprintf(path, len, "%d", libusb_get_bus_number(device));
+	n = libusb_get_port_numbers(device, ports, sizeof(ports));
+
+	for (i = 0; i < n && pos > 0 && (size_t)pos < len; i++)
+		pos += snprintf(path + pos, len - pos, "%c%d",
+				i ? '.' : '-', ports[i]);
+#else
+	snprintf(path, len, "%d-%d", libusb_get_bus_number(device),
+		 libusb_get_device_address(device));
+#endif
+}
+
+#if LIBUSB_API_VERSION >= 0x01000102
+static int LIBUSB_CALL fl2k_hotplug_callback(libusb_context *ctx,
+					     libusb_device *device,
+					     libusb_hotplug_event event,
+					     void *user_data)
+{
+	struct libusb_device_descriptor dd;
+	uint32_t i;
+
+	if (libusb_get_device_descriptor(device, &dd) < 0 ||
+	    !find_known_device(dd.idVendor, dd.idProduct))
+		return 0;
+
+	/* also dispatched by lookups, with the cache lock held */
+	fl2k_atomic_add(&fl2k_cache.events, 1);
+
+	pthread_mutex_lock(&fl2k_cache.ev_lock);
+
+	if (fl2k_cache.ev_queue && fl2k_cache.ev_count < FL2K_HOTPLUG_QUEUE) {
+		i = (fl2k_cache.ev_head + fl2k_cache.ev_count++) %
+		    FL2K_HOTPLUG_QUEUE;
+		fl2k_cache.ev[i].arrived =
+			(event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+		fl2k_usb_path(device, fl2k_cache.ev[i].path,
+			      sizeof(fl2k_cache.ev[i].path));
+	}
+
+	pthread_mutex_unlock(&fl2k_cache.ev_lock);
+
 	return 0;
 }
 
-static int _fl2k_free_async_buffers(fl2k_dev_t *dev)
+/* call the application for the queued events, without holding a lock */
+static void fl2k_hotplug_deliver(void)
 {
-	unsigned int i;
+	char path[FL2K_PATH_LEN];
+	int arrived;
 
-	if (!dev)
-		return FL2K_ERROR_INVALID_PARAM;
+	for (;;) {
+		pthread_mutex_lock(&fl2k_cache.ev_lock);
 
-	if (dev->xfer) {
-		for (i = 0; i < dev->xfer_buf_num; ++i) {
-			if (dev->xfer[i]) {
-				libusb_free_transfer(dev->xfer[i]);
-			}
+		if (!fl2k_cache.ev_count) {
+			pthread_mutex_unlock(&fl2k_cache.ev_lock);
+			return;
 		}
 
-		free(dev->xfer);
-		dev->xfer = NULL;
+		arrived = fl2k_cache.ev[fl2k_cache.ev_head].arrived;
+		memcpy(path, fl2k_cache.ev[fl2k_cache.ev_head].path,
+		       sizeof(path));
+		fl2k_cache.ev_head = (fl2k_cache.ev_head + 1) %
+				     FL2K_HOTPLUG_QUEUE;
+		fl2k_cache.ev_count--;
+
+		pthread_mutex_unlock(&fl2k_cache.ev_lock);
+
+		fl2k_cache.cb(arrived, path, fl2k_cache.cb_ctx);
 	}
+}
 
-	if (dev->xfer_buf) {
-		for (i = 0; i < dev->xfer_buf_num; ++i) {
-			if (dev->xfer_buf[i]) {
-				if (dev->use_zerocopy) {
-#if defined (__linux__) && LIBUSB_API_VERSION >= 0x01000105
-					libusb_dev_mem_free(dev->devh,
-							    dev->xfer_buf[i],
-							    dev->xfer_buf_len);
-#endif
-				} else {
-					free(dev->xfer_buf[i]);
-				}
-			}
-		}
+static void *fl2k_hotplug_worker(void *arg)
+{
+	struct timeval tv = { 0, 100000 };
 
-		free(dev->xfer_buf);
-		dev->xfer_buf = NULL;
+	while (fl2k_cache.thread_running) {
+		libusb_handle_events_timeout_completed(fl2k_cache.ctx, &tv, NULL);
+		fl2k_hotplug_deliver();
 	}
 
-	return 0;
+	pthread_exit(NULL);
 }
+#endif
 
-static void *fl2k_usb_worker(void *arg)
+/* must be called with the cache lock held */
+static int fl2k_cache_update(void)
 {
-	fl2k_dev_t *dev = (fl2k_dev_t *)arg;
-	struct timeval tv = { 1, 0 };
-	struct timeval zerotv = { 0, 0 };
-	enum fl2k_async_status next_status = FL2K_INACTIVE;
-	int r = 0;
-	unsigned int i;
+	libusb_device **list;
+	struct libusb_device_descriptor dd;
+	fl2k_dongle_t *dongle;
+	fl2k_cache_entry_t *e;
+	ssize_t cnt;
+	uint32_t i, events;
+	int r;
 
-	while (FL2K_RUNNING == dev->async_status) {
-		r = libusb_handle_events_timeout_completed(dev->ctx, &tv,
-							   &dev->async_cancel);
+	if (!fl2k_cache.ctx) {
+		r = libusb_init(&fl2k_cache.ctx);
+		if (r < 0) {
+			fl2k_cache.ctx = NULL;
+			return r;
+		}
+
+#if LIBUSB_API_VERSION >= 0x01000106
+		libusb_set_option(fl2k_cache.ctx, LIBUSB_OPTION_LOG_LEVEL, 3);
+#else
+		libusb_set_debug(fl2k_cache.ctx, 3);
+#endif
+
+#if LIBUSB_API_VERSION >= 0x01000102
+		if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+		    libusb_hotplug_register_callback(fl2k_cache.ctx,
+				LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+				LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+				LIBUSB_HOTPLUG_NO_FLAGS,
+				LIBUSB_HOTPLUG_MATCH_ANY,
+				LIBUSB_HOTPLUG_MATCH_ANY,
+				LIBUSB_HOTPLUG_MATCH_ANY,
+				fl2k_hotplug_callback, NULL, NULL) == 0)
+			fl2k_cache.hotplug = 1;
+#endif
 	}
 
-	while (FL2K_INACTIVE != dev->async_status) {
-		r = libusb_handle_events_timeout_completed(dev->ctx, &tv,
-							   &dev->async_cancel);
-		if (r < 0) {
-			/*fprintf(stderr, "handle_events returned: %d\n", r);*/
-			if (r == LIBUSB_ERROR_INTERRUPTED) /* stray signal */
-				continue;
+	if (fl2k_cache.hotplug && !fl2k_cache.thread_running) {
+		struct timeval tv = { 0, 0 };
+		libusb_handle_events_timeout_completed(fl2k_cache.ctx, &tv, NULL);
+	}
+
+	/* an event arriving while enumerating triggers the next rebuild */
+	events = fl2k_cache.events;
+	__sync_synchronize();
+
+	if (fl2k_cache.hotplug && fl2k_cache.valid &&
+	    events == fl2k_cache.events_seen)
+		return 0;
+
+	for (i = 0; i < fl2k_cache.count; i++)
+		libusb_unref_device(fl2k_cache.dev[i].device);
+
+	fl2k_cache.count = 0;
+
+	cnt = libusb_get_device_list(fl2k_cache.ctx, &list);
+
+	for (i = 0; cnt > 0 && i < (uint32_t)cnt; i++) {
+		if (fl2k_cache.count == FL2K_MAX_DEVICES)
 			break;
-		}
 
-		if (FL2K_CANCELING == dev->async_status) {
-			next_status = FL2K_INACTIVE;
+		libusb_get_device_descriptor(list[i], &dd);
 
-			if (!dev->xfer)
-				break;
+		dongle = find_known_device(dd.idVendor, dd.idProduct);
+		if (!dongle)
+			continue;
 
-			for (i = 0; i < dev->xfer_buf_num; ++i) {
-				if (!dev->xfer[i])
-					continue;
+		e = &fl2k_cache.dev[fl2k_cache.count++];
+		e->device = libusb_ref_device(list[i]);
+		e->dongle = dongle;
+		e->serial_read = 0;
+		e->serial[0] = '\0';
+		fl2k_usb_path(list[i], e->path, sizeof(e->path));
+	}
 
-				if (LIBUSB_TRANSFER_CANCELLED !=
+	if (cnt >= 0)
+		libusb_free_device_list(list, 1);
+
+	fl2k_cache.valid = 1;
+	fl2k_cache.events_seen = events;
+
+	return 0;
+}
+
+/* must be called with the cache lock held */
+static const char *fl2k_cache_serial(fl2k_cache_entry_t *e)
+{
+	struct libusb_device_descriptor dd;
+	libusb_device_handle *devh;
+
+	if (e->serial_read)
+		return e->serial;
+
+	e->serial_read = 1;
+
+	if (libusb_get_device_descriptor(e->device, &dd) < 0 ||
+	    !dd.iSerialNumber)
+		return e->serial;
+
+	if (libusb_open(e->device, &devh) < 0)
+		return e->serial;
+
+	if (libusb_get_string_descriptor_ascii(devh, dd.iSerialNumber,
+			(unsigned char *)e->serial, sizeof(e->serial)) < 0)
+		e->serial[0] = '\0';
+
+	libusb_close(devh);
+
+	return e->serial;
+}
+
+uint32_t fl2k_get_device_count(void)
+{
+	uint32_t device_count = 0;
+
+	pthread_mutex_lock(&fl2k_cache.lock);
+
+	if (fl2k_cache_update() == 0)
+		device_count = fl2k_cache.count;
+
+	pthread_mutex_unlock(&fl2k_cache.lock);
+
+	return device_count;
+}
+
+const char *fl2k_get_device_name(uint32_t index)
+{
+	const char *name = "";
+
+	pthread_mutex_lock(&fl2k_cache.lock);
+
+	if (fl2k_cache_update() == 0 && index < fl2k_cache.count)
+		name = fl2k_cache.dev[index].dongle->name;
+
+	pthread_mutex_unlock(&fl2k_cache.lock);
+
+	return name;
+}
+
+int fl2k_get_device_path(uint32_t index, char *path, size_t len)
+{
+	int r = FL2K_ERROR_NOT_FOUND;
+
+	if (!path || !len)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	pthread_mutex_lock(&fl2k_cache.lock);
+
+	if (fl2k_cache_update() == 0 && index < fl2k_cache.count) {
+		snprintf(path, len, "%s", fl2k_cache.dev[index].path);
+		r = 0;
+	}
+
+	pthread_mutex_unlock(&fl2k_cache.lock);
+
+	return r;
+}
+
+/* must be called with the cache lock held */
+static int fl2k_cache_find_path(const char *path)
+{
+	uint32_t i;
+
+	if (fl2k_cache_update() < 0 || !fl2k_cache.count)
+		return FL2K_ERROR_NO_DEVICE;
+
+	for (i = 0; i < fl2k_cache.count; i++) {
+		if (!strcmp(path, fl2k_cache.dev[i].path))
+			return i;
+	}
+
+	return FL2K_ERROR_NOT_FOUND;
+}
+
+/* must be called with the cache lock held */
+static int fl2k_cache_find_serial(const char *serial)
+{
+	uint32_t i;
+
+	if (fl2k_cache_update() < 0 || !fl2k_cache.count)
+		return FL2K_ERROR_NO_DEVICE;
+
+	for (i = 0; i < fl2k_cache.count; i++) {
+		if (!strcmp(serial, fl2k_cache_serial(&fl2k_cache.dev[i])))
+			return i;
+	}
+
+	return FL2K_ERROR_NOT_FOUND;
+}
+
+int fl2k_get_index_by_path(const char *path)
+{
+	int r;
+
+	if (!path)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	pthread_mutex_lock(&fl2k_cache.lock);
+	r = fl2k_cache_find_path(path);
+	pthread_mutex_unlock(&fl2k_cache.lock);
+
+	return r;
+}
+
+int fl2k_get_index_by_serial(const char *serial)
+{
+	int r;
+
+	if (!serial)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	pthread_mutex_lock(&fl2k_cache.lock);
+	r = fl2k_cache_find_serial(serial);
+	pthread_mutex_unlock(&fl2k_cache.lock);
+
+	return r;
+}
+
+int fl2k_set_hotplug_callback(fl2k_hotplug_cb_t cb, void *ctx)
+{
+#if LIBUSB_API_VERSION >= 0x01000102
+	static pthread_mutex_t cb_lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_t thread;
+	int running;
+	int r = 0;
+
+	/* serializes the callers, the cache lock can't be held while
+	 * joining: the callback may look up devices */
+	pthread_mutex_lock(&cb_lock);
+	pthread_mutex_lock(&fl2k_cache.lock);
+
+	if (fl2k_cache_update() < 0 || !fl2k_cache.hotplug) {
+		pthread_mutex_unlock(&fl2k_cache.lock);
+		pthread_mutex_unlock(&cb_lock);
+		return FL2K_ERROR_NOT_SUPPORTED;
+	}
+
+	running = fl2k_cache.thread_running;
+	thread = fl2k_cache.thread;
+	fl2k_cache.thread_running = 0;
+
+	pthread_mutex_unlock(&fl2k_cache.lock);
+
+	if (running)
+		pthread_join(thread, NULL);
+
+	/* drop what the old callback did not get */
+	pthread_mutex_lock(&fl2k_cache.ev_lock);
+	fl2k_cache.ev_queue = 0;
+	fl2k_cache.ev_head = 0;
+	fl2k_cache.ev_count = 0;
+	pthread_mutex_unlock(&fl2k_cache.ev_lock);
+
+	pthread_mutex_lock(&fl2k_cache.lock);
+
+	fl2k_cache.cb_ctx = ctx;
+	fl2k_cache.cb = cb;
+
+	if (cb) {
+		pthread_mutex_lock(&fl2k_cache.ev_lock);
+		fl2k_cache.ev_queue = 1;
+		pthread_mutex_unlock(&fl2k_cache.ev_lock);
+
+		fl2k_cache.thread_running = 1;
+		if (pthread_create(&fl2k_cache.thread, NULL,
+				   fl2k_hotplug_worker, NULL)) {
+			fl2k_cache.thread_running = 0;
+			fl2k_cache.cb = NULL;
+
+			pthread_mutex_lock(&fl2k_cache.ev_lock);
+			fl2k_cache.ev_queue = 0;
+			pthread_mutex_unlock(&fl2k_cache.ev_lock);
+
+			r = FL2K_ERROR_BUSY;
+		}
+	}
+
+	pthread_mutex_unlock(&fl2k_cache.lock);
+	pthread_mutex_unlock(&cb_lock);
+
+	return r;
+#else
+	return FL2K_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/* open a referenced device of the cache, the reference is dropped */
+static int fl2k_open_device(fl2k_dev_t **out_dev, libusb_device *device)
+{
+	int r;
+	fl2k_dev_t *dev = NULL;
+
+	dev = malloc(sizeof(fl2k_dev_t));
+	if (NULL == dev) {
+		libusb_unref_device(device);
+		return -ENOMEM;
+	}
+
+	memset(dev, 0, sizeof(fl2k_dev_t));
+
+	/* transfers are handled on the context of the cache */
+	dev->ctx = fl2k_cache.ctx;
+
+	pthread_mutex_init(&dev->i2c_mutex, NULL);
+	pthread_mutex_init(&dev->wm_mutex, NULL);
+
+	dev->dev_lost = 1;
+
+	r = libusb_open(device, &dev->devh);
+	libusb_unref_device(device);
+	if (r < 0) {
+		fprintf(stderr, "usb_open error %d\n", r);
+		if(r == LIBUSB_ERROR_ACCESS)
+			fprintf(stderr, "Please fix the device permissions, e.g. "
+			"by installing the udev rules file\n");
+		goto err;
+	}
+
+	/* If the adapter has an SPI flash for the Windows driver, we
+	 * need to detach the USB mass storage driver first in order to
+	 * open the device */
+	if (libusb_kernel_driver_active(dev->devh, 3) == 1) {
+		fprintf(stderr, "Kernel mass storage driver is attached, "
+				"detaching driver. This may take more than"
+				" 10 seconds!\n");
+		r = libusb_detach_kernel_driver(dev->devh, 3);
+		if (r < 0) {
+			fprintf(stderr, "Failed to detach mass storage "
+					"driver: %d\n", r);
+			goto err;
+		}
+	}
+
+	r = libusb_claim_interface(dev->devh, 0);
+	if (r < 0) {
+		fprintf(stderr, "usb_claim_interface 0 error %d\n", r);
+		goto err;
+	}
+
+	r = libusb_set_interface_alt_setting(dev->devh, 0, 1);
+	if (r < 0) {
+		fprintf(stderr, "Failed to switch interface 0 to "
+				"altsetting 1, trying to use interface 1\n");
+
+		r = libusb_claim_interface(dev->devh, 1);
+		if (r < 0) {
+			fprintf(stderr, "Could not claim interface 1: %d\n", r);
+		}
+	}
+
+	r = fl2k_init_device(dev);
+	if (r < 0)
+		goto err;
+
+	dev->dev_lost = 0;
+
+	/* allow tracing of unmodified applications */
+	if (getenv("FL2K_TRACE"))
+		fl2k_trace_enable(dev, DEFAULT_TRACE_EVENTS,
+				  getenv("FL2K_TRACE"));
+
+	if (getenv("FL2K_METRICS"))
+		fl2k_metrics_start(dev, getenv("FL2K_METRICS"),
+				   DEFAULT_METRICS_INTERVAL);
+
+	if (getenv("FL2K_SPECTRUM"))
+		fl2k_spectrum_start(dev, getenv("FL2K_SPECTRUM"), 0, 0);
+
+	*out_dev = dev;
+	return 0;
+err:
+	if (dev) {
+		if (dev->devh)
+			libusb_close(dev->devh);
+
+		pthread_mutex_destroy(&dev->i2c_mutex);
+		pthread_mutex_destroy(&dev->wm_mutex);
+		free(dev);
+	}
+
+	return r;
+}
+
+int fl2k_open(fl2k_dev_t **out_dev, uint32_t index)
+{
+	libusb_device *device = NULL;
+	int r;
+
+	pthread_mutex_lock(&fl2k_cache.lock);
+
+	if (fl2k_cache_update() == 0 && index < fl2k_cache.count)
+		device = libusb_ref_device(fl2k_cache.dev[index].device);
+
+	pthread_mutex_unlock(&fl2k_cache.lock);
+
+	if (!device)
+		return FL2K_ERROR_NOT_FOUND;
+
+	r = fl2k_open_device(out_dev, device);
+	if (r == 0)
+		fprintf(stderr, "Opening device %d\n", index);
+
+	return r;
+}
+
+int fl2k_open_by_path(fl2k_dev_t **out_dev, const char *path)
+{
+	libusb_device *device = NULL;
+	int r;
+
+	if (!out_dev || !path)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	pthread_mutex_lock(&fl2k_cache.lock);
+
+	r = fl2k_cache_find_path(path);
+	if (r >= 0)
+		device = libusb_ref_device(fl2k_cache.dev[r].device);
+
+	pthread_mutex_unlock(&fl2k_cache.lock);
+
+	if (!device)
+		return r;
+
+	r = fl2k_open_device(out_dev, device);
+	if (r == 0)
+		fprintf(stderr, "Opening device at %s\n", path);
+
+	return r;
+}
+
+int fl2k_open_by_serial(fl2k_dev_t **out_dev, const char *serial)
+{
+	libusb_device *device = NULL;
+	int r;
+
+	if (!out_dev || !serial)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	pthread_mutex_lock(&fl2k_cache.lock);
+
+	r = fl2k_cache_find_serial(serial);
+	if (r >= 0)
+		device = libusb_ref_device(fl2k_cache.dev[r].device);
+
+	pthread_mutex_unlock(&fl2k_cache.lock);
+
+	if (!device)
+		return r;
+
+	r = fl2k_open_device(out_dev, device);
+	if (r == 0)
+		fprintf(stderr, "Opening device %s\n", serial);
+
+	return r;
+}
+
+int fl2k_close(fl2k_dev_t *dev)
+{
+	if (!dev)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	if(!dev->dev_lost) {
+		/* block until all async operations have been completed (if any) */
+		while (FL2K_INACTIVE != dev->async_status)
+			sleep_ms(100);
+
+		fl2k_deinit_device(dev);
+	}
+
+	fl2k_metrics_stop(dev);
+
+	if (dev->spectrum)
+		fl2k_spectrum_free(dev);
+
+	if (dev->trace) {
+		if (dev->trace->path)
+			fl2k_trace_dump(dev, dev->trace->path);
+
+		fl2k_trace_free(dev->trace);
+	}
+
+	libusb_release_interface(dev->devh, 0);
+	libusb_close(dev->devh);
+
+	pthread_mutex_destroy(&dev->i2c_mutex);
+	pthread_mutex_destroy(&dev->wm_mutex);
+	free(dev);
+
+	return 0;
+}
+
+static struct libusb_transfer *fl2k_get_next_xfer(fl2k_dev_t *dev,
+					          fl2k_buf_state_t state)
+{
+	unsigned int i;
+	int next_buf = -1;
+	uint64_t next_seq = 0;
+	fl2k_xfer_info_t *xfer_info;
+
+	for (i = 0; i < dev->xfer_buf_num; i++) {
+		xfer_info = (fl2k_xfer_info_t *)dev->xfer[i]->user_data;
+		if (!xfer_info)
+			continue;
+
+		if (xfer_info->state == state) {
+			if (state == BUF_EMPTY) {
+				return dev->xfer[i];
+			} else if ((xfer_info->seq < next_seq) || next_buf < 0) {
+				next_seq = xfer_info->seq;
+				next_buf = i;
+			}
+		}
+	}
+
+	/* transfers are submitted strictly in sequence, with several
+	 * sample workers the next one might still be filled */
+	if ((state == BUF_FILLED) && (next_buf >= 0) &&
+	    (next_seq == dev->submit_seq))
+		return dev->xfer[next_buf];
+	else
+		return NULL;
+}
+
+/* number of filled transfers that can be submitted in a row */
+static uint32_t fl2k_count_ready_xfers(fl2k_dev_t *dev)
+{
+	unsigned int i;
+	uint32_t cnt = 0;
+	int found;
+
+	do {
+		found = 0;
+
+		for (i = 0; i < dev->xfer_buf_num; i++) {
+			if (dev->xfer_info[i].state == BUF_FILLED &&
+			    dev->xfer_info[i].seq == dev->submit_seq + cnt) {
+				found = 1;
+				cnt++;
+				break;
+			}
+		}
+	} while (found);
+
+	return cnt;
+}
+
+static uint32_t fl2k_count_xfers(fl2k_dev_t *dev, fl2k_buf_state_t state)
+{
+	unsigned int i;
+	uint32_t cnt = 0;
+
+	for (i = 0; i < dev->xfer_buf_num; i++)
+		if (dev->xfer_info[i].state == state)
+			cnt++;
+
+	return cnt;
+}
+
+/* Transfer seq has just been sent, switch the rate for the next one.
+ * The FIFO of the FL2000 is small compared to a transfer, so the change
+ * takes effect close to the start of the transfer it was queued for. */
+static void fl2k_submit_rate_changes(fl2k_dev_t *dev, uint64_t seq)
+{
+	fl2k_rate_change_t *change;
+
+	pthread_mutex_lock(&dev->buf_mutex);
+
+	while (dev->rate_head != dev->rate_tail) {
+		change = &dev->rate_queue[dev->rate_head];
+		if (change->seq > seq + 1)
+			break;
+
+		if (libusb_submit_transfer(change->xfer) < 0)
+			libusb_free_transfer(change->xfer);
+
+		change->xfer = NULL;
+		dev->rate_head = (dev->rate_head + 1) % FL2K_RATE_QUEUE;
+	}
+
+	pthread_mutex_unlock(&dev->buf_mutex);
+}
+
+/* tell the application when the filled transfers drop below the low
+ * watermark, and when they are back */
+static void fl2k_check_watermark(fl2k_dev_t *dev, uint32_t depth)
+{
+	fl2k_watermark_cb_t cb = NULL;
+	void *ctx = NULL;
+	int low;
+
+	pthread_mutex_lock(&dev->wm_mutex);
+
+	low = depth < dev->wm_level;
+	if (dev->wm_level && low != dev->wm_low) {
+		dev->wm_low = low;
+		cb = dev->wm_cb;
+		ctx = dev->wm_ctx;
+	}
+
+	pthread_mutex_unlock(&dev->wm_mutex);
+
+	/* called without the lock, it may change the watermark */
+	if (cb)
+		cb(depth, low, ctx);
+}
+
+static void LIBUSB_CALL _libusb_callback(struct libusb_transfer *xfer)
+{
+	fl2k_xfer_info_t *xfer_info = (fl2k_xfer_info_t *)xfer->user_data;
+	fl2k_xfer_info_t *next_xfer_info;
+	fl2k_dev_t *dev = (fl2k_dev_t *)xfer_info->dev;
+	struct libusb_transfer *next_xfer = NULL;
+	int drain_done = 0;
+	int r = 0;
+
+	fl2k_trace(dev, FL2K_RING_USB, FL2K_TRACE_COMPLETE, 'i', xfer_info->seq);
+
+	/* an idle buffer was sent, the transfer gets its own one back */
+	if (xfer->buffer == dev->idle_buf)
+		xfer->buffer = dev->xfer_buf[xfer_info - dev->xfer_info];
+
+	if (LIBUSB_TRANSFER_COMPLETED == xfer->status) {
+		dev->stats.last_complete_ns = fl2k_now_ns();
+		dev->stats.xfers_completed++;
+
+		if (dev->rate_head != dev->rate_tail)
+			fl2k_submit_rate_changes(dev, xfer_info->seq);
+
+		/* keep the device busy with the idle buffer, the filled
+		 * transfers are kept for resuming */
+		if (dev->paused && FL2K_RUNNING == dev->async_status) {
+			xfer->buffer = dev->idle_buf;
+			r = libusb_submit_transfer(xfer);
+		} else if (FL2K_RUNNING == dev->async_status) {
+			/* when draining, the sample worker stops filling
+			 * transfers at some point */
+			if (dev->drain) {
+				pthread_mutex_lock(&dev->buf_mutex);
+				drain_done = dev->drain_done;
+				pthread_mutex_unlock(&dev->buf_mutex);
+			}
+
+			/* get next transfer */
+			next_xfer = fl2k_get_next_xfer(dev, BUF_FILLED);
+
+			if (next_xfer) {
+				next_xfer_info = (fl2k_xfer_info_t *) next_xfer->user_data;
+
+				/* Submit next filled transfer */
+				next_xfer_info->state = BUF_SUBMITTED;
+				dev->submit_seq = next_xfer_info->seq + 1;
+				fl2k_trace(dev, FL2K_RING_USB, FL2K_TRACE_SUBMIT,
+					   'i', next_xfer_info->seq);
+				r = libusb_submit_transfer(next_xfer);
+				pthread_mutex_lock(&dev->buf_mutex);
+				xfer_info->state = BUF_EMPTY;
+				pthread_cond_signal(&dev->buf_cond);
+				pthread_mutex_unlock(&dev->buf_mutex);
+			} else if (drain_done) {
+				/* nothing left to send, stop after the
+				 * last transfer in flight */
+				xfer_info->state = BUF_EMPTY;
+
+				if (!fl2k_count_xfers(dev, BUF_SUBMITTED)) {
+					dev->drained = 1;
+					fl2k_stop_tx(dev);
+				}
+			} else {
+				/* We need to re-submit the transfer
+				 * in any case, as otherwise the device
+				 * stops to output data and hangs
+				 * (happens only in the hacked 'gapless'
+				 * mode without HSYNC and VSYNC)  */
+				fl2k_trace(dev, FL2K_RING_USB,
+					   FL2K_TRACE_UNDERFLOW, 'i',
+					   xfer_info->seq);
+				r = libusb_submit_transfer(xfer);
+				dev->underflow_cnt++;
+				dev->stats.underflows++;
+			}
+
+			dev->stats.queue_depth = fl2k_count_xfers(dev, BUF_FILLED);
+
+			if (!dev->drain)
+				fl2k_check_watermark(dev, dev->stats.queue_depth);
+		}
+	}
+
+	if (((LIBUSB_TRANSFER_CANCELLED != xfer->status) &&
+	     (LIBUSB_TRANSFER_COMPLETED != xfer->status)) ||
+	     (r == LIBUSB_ERROR_NO_DEVICE)) {
+			if (!dev->dev_lost)
+				dev->stats.dev_lost++;
+			dev->dev_lost = 1;
+			fl2k_stop_tx(dev);
+			pthread_mutex_lock(&dev->buf_mutex);
+			pthread_cond_broadcast(&dev->buf_cond);
+			pthread_mutex_unlock(&dev->buf_mutex);
+			fprintf(stderr, "cb transfer status: %d, submit "
+				"transfer %d, canceling...\n", xfer->status, r);
+	}
+}
+
+static const char fl2k_incr_usbfs[] = "Please increase your allowed usbfs "
+				      "buffer size with the following "
+				      "command:\necho 0 > /sys/module/usbcore/"
+				      "parameters/usbfs_memory_mb\n";
+
+static int fl2k_alloc_transfers(fl2k_dev_t *dev)
+{
+	unsigned int i;
+
+	if (!dev)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	dev->xfer = malloc(dev->xfer_buf_num * sizeof(struct libusb_transfer *));
+
+	for (i = 0; i < dev->xfer_buf_num; ++i)
+		dev->xfer[i] = libusb_alloc_transfer(0);
+
+	dev->xfer_buf = malloc(dev->xfer_buf_num * sizeof(unsigned char *));
+	memset(dev->xfer_buf, 0, dev->xfer_buf_num * sizeof(unsigned char *));
+
+	dev->xfer_info = malloc(dev->xfer_buf_num * sizeof(fl2k_xfer_info_t));
+	memset(dev->xfer_info, 0, dev->xfer_buf_num * sizeof(fl2k_xfer_info_t));
+
+#if defined (__linux__) && LIBUSB_API_VERSION >= 0x01000105
+	fprintf(stderr, "Allocating %d zero-copy buffers\n", dev->xfer_buf_num);
+
+	dev->use_zerocopy = 1;
+	for (i = 0; i < dev->xfer_buf_num; ++i) {
+		dev->xfer_buf[i] = libusb_dev_mem_alloc(dev->devh, dev->xfer_buf_len);
+
+		if (dev->xfer_buf[i]) {
+			/* Check if Kernel usbfs mmap() bug is present: if the
+			 * mapping is correct, the buffers point to memory that
+			 * was memset to 0 by the Kernel, otherwise, they point
+			 * to random memory. We check if the buffers are zeroed
+			 * and otherwise fall back to buffers in userspace.
+			 */
+			if (dev->xfer_buf[i][0] || memcmp(dev->xfer_buf[i],
+							  dev->xfer_buf[i] + 1,
+							  dev->xfer_buf_len - 1)) {
+				fprintf(stderr, "Detected Kernel usbfs mmap() "
+						"bug, falling back to buffers "
+						"in userspace\n");
+				dev->use_zerocopy = 0;
+				break;
+			}
+		} else {
+			fprintf(stderr, "Failed to allocate zero-copy "
+					"buffer for transfer %d\n%sFalling "
+					"back to buffers in userspace\n",
+					i, fl2k_incr_usbfs);
+			dev->use_zerocopy = 0;
+			break;
+		}
+	}
+
+	/* zero-copy buffer allocation failed (partially or completely)
+	 * we need to free the buffers again if already allocated */
+	if (!dev->use_zerocopy) {
+		for (i = 0; i < dev->xfer_buf_num; ++i) {
+			if (dev->xfer_buf[i])
+				libusb_dev_mem_free(dev->devh,
+						    dev->xfer_buf[i],
+						    dev->xfer_buf_len);
+		}
+	}
+#endif
+
+	/* no zero-copy available, allocate buffers in userspace */
+	if (!dev->use_zerocopy) {
+		for (i = 0; i < dev->xfer_buf_num; ++i) {
+			dev->xfer_buf[i] = malloc(dev->xfer_buf_len);
+
+			if (!dev->xfer_buf[i])
+				return FL2K_ERROR_NO_MEM;
+		}
+	}
+
+	dev->idle_buf = calloc(1, dev->xfer_buf_len);
+	if (!dev->idle_buf)
+		return FL2K_ERROR_NO_MEM;
+
+	/* fill transfers */
+	for (i = 0; i < dev->xfer_buf_num; ++i) {
+		libusb_fill_bulk_transfer(dev->xfer[i],
+					  dev->devh,
+					  0x01,
+					  dev->xfer_buf[i],
+					  dev->xfer_buf_len,
+					  _libusb_callback,
+					  &dev->xfer_info[i],
+					  0);
+
+		dev->xfer_info[i].dev = dev;
+		dev->xfer_info[i].state = BUF_EMPTY;
+
+		/* if we allocate the memory through the Kernel, it is
+		 * already cleared */
+		if (!dev->use_zerocopy)
+			memset(dev->xfer_buf[i], 0, dev->xfer_buf_len);
+	}
+
+	return 0;
+}
+
+/* Wait until the sample workers have filled all transfers, or the prefill
+ * timeout has passed */
+static void fl2k_prefill_transfers(fl2k_dev_t *dev)
+{
+	uint64_t deadline = fl2k_now_ns() + dev->prefill_ms * 1000000ULL;
+	uint32_t filled;
+
+	while ((filled = fl2k_count_ready_xfers(dev)) < dev->xfer_num) {
+		if (fl2k_now_ns() >= deadline ||
+		    FL2K_RUNNING != dev->async_status) {
+			fprintf(stderr, "Prefilled %u of %u transfers\n",
+					filled, dev->xfer_num);
+			break;
+		}
+
+		sleep_ms(1);
+	}
+}
+
+static int fl2k_submit_transfers(fl2k_dev_t *dev)
+{
+	struct libusb_transfer *xfer;
+	fl2k_xfer_info_t *xfer_info;
+	uint32_t i, filled;
+	int r = 0;
+
+	pthread_mutex_lock(&dev->buf_mutex);
+
+	filled = fl2k_count_ready_xfers(dev);
+	if (filled > dev->xfer_num)
+		filled = dev->xfer_num;
+
+	/* submit transfers, any still empty (zeroed) ones first, so the
+	 * samples already filled in are sent without interruption */
+	for (i = 0; i < dev->xfer_num; ++i) {
+		xfer = fl2k_get_next_xfer(dev, (i < dev->xfer_num - filled) ?
+					       BUF_EMPTY : BUF_FILLED);
+		if (!xfer)
+			break;
+
+		xfer_info = (fl2k_xfer_info_t *)xfer->user_data;
+		if (xfer_info->state == BUF_FILLED)
+			dev->submit_seq = xfer_info->seq + 1;
+
+		xfer_info->state = BUF_SUBMITTED;
+		fl2k_trace(dev, FL2K_RING_USB, FL2K_TRACE_SUBMIT, 'i',
+			   xfer_info->seq);
+
+		r = libusb_submit_transfer(xfer);
+		if (r < 0) {
+			fprintf(stderr, "Failed to submit transfer %i\n%s",
+					i, fl2k_incr_usbfs);
+			break;
+		}
+	}
+
+	dev->stats.queue_depth = fl2k_count_xfers(dev, BUF_FILLED);
+	pthread_mutex_unlock(&dev->buf_mutex);
+
+	return r;
+}
+
+static int _fl2k_free_async_buffers(fl2k_dev_t *dev)
+{
+	unsigned int i;
+
+	if (!dev)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	if (dev->xfer) {
+		for (i = 0; i < dev->xfer_buf_num; ++i) {
+			if (dev->xfer[i]) {
+				libusb_free_transfer(dev->xfer[i]);
+			}
+		}
+
+		free(dev->xfer);
+		dev->xfer = NULL;
+	}
+
+	if (dev->xfer_buf) {
+		for (i = 0; i < dev->xfer_buf_num; ++i) {
+			if (dev->xfer_buf[i]) {
+				if (dev->use_zerocopy) {
+#if defined (__linux__) && LIBUSB_API_VERSION >= 0x01000105
+					libusb_dev_mem_free(dev->devh,
+							    dev->xfer_buf[i],
+							    dev->xfer_buf_len);
+#endif
+				} else {
+					free(dev->xfer_buf[i]);
+				}
+			}
+		}
+
+		free(dev->xfer_buf);
+		dev->xfer_buf = NULL;
+	}
+
+	free(dev->idle_buf);
+	dev->idle_buf = NULL;
+
+	/* drop rate changes that were not reached */
+	while (dev->rate_head != dev->rate_tail) {
+		libusb_free_transfer(dev->rate_queue[dev->rate_head].xfer);
+		dev->rate_queue[dev->rate_head].xfer = NULL;
+		dev->rate_head = (dev->rate_head + 1) % FL2K_RATE_QUEUE;
+	}
+
+	return 0;
+}
+
+static void fl2k_join_workers(fl2k_dev_t *dev, uint32_t num)
+{
+	uint32_t i;
+
+	if (!dev->workers)
+		return;
+
+	for (i = 0; i < num; i++)
+		pthread_join(dev->workers[i].thread, NULL);
+
+	free(dev->workers);
+	dev->workers = NULL;
+}
+
+static void *fl2k_usb_worker(void *arg)
+{
+	fl2k_dev_t *dev = (fl2k_dev_t *)arg;
+	struct timeval tv = { 1, 0 };
+	struct timeval zerotv = { 0, 0 };
+	enum fl2k_async_status next_status = FL2K_INACTIVE;
+	fl2k_data_info_t data_info;
+	int r = 0;
+	unsigned int i;
+
+	while (FL2K_RUNNING == dev->async_status) {
+		r = libusb_handle_events_timeout_completed(dev->ctx, &tv,
+							   &dev->async_cancel);
+		fl2k_trace_poll_dump(dev);
+	}
+
+	while (FL2K_INACTIVE != dev->async_status) {
+		r = libusb_handle_events_timeout_completed(dev->ctx, &tv,
+							   &dev->async_cancel);
+		if (r < 0) {
+			/*fprintf(stderr, "handle_events returned: %d\n", r);*/
+			if (r == LIBUSB_ERROR_INTERRUPTED) /* stray signal */
+				continue;
+			break;
+		}
+
+		if (FL2K_CANCELING == dev->async_status) {
+			next_status = FL2K_INACTIVE;
+
+			if (!dev->xfer)
+				break;
+
+			for (i = 0; i < dev->xfer_buf_num; ++i) {
+				if (!dev->xfer[i])
+					continue;
+
+				if (LIBUSB_TRANSFER_CANCELLED !=
 						dev->xfer[i]->status) {
 					r = libusb_cancel_transfer(dev->xfer[i]);
 					/* handle events after canceling
@@ -913,346 +2442,1950 @@ static void *fl2k_usb_worker(void *arg)
 					if (r < 0)
 						continue;
 
-					next_status = FL2K_CANCELING;
-				}
-			}
+					next_status = FL2K_CANCELING;
+				}
+			}
+
+			if (dev->dev_lost || FL2K_INACTIVE == next_status) {
+				/* handle any events that still need to
+				 * be handled before exiting after we
+				 * just cancelled all transfers */
+				libusb_handle_events_timeout_completed(dev->ctx,
+								       &zerotv, NULL);
+				break;
+			}
+		}
+	}
+
+	/* wake up sample workers */
+	pthread_mutex_lock(&dev->buf_mutex);
+	pthread_cond_broadcast(&dev->buf_cond);
+	pthread_mutex_unlock(&dev->buf_mutex);
+
+	/* wait for sample worker threads to finish before freeing buffers */
+	fl2k_join_workers(dev, dev->worker_num);
+	_fl2k_free_async_buffers(dev);
+
+	/* notify application if we've lost the device */
+	if (dev->dev_lost && dev->cb) {
+		memset(&data_info, 0, sizeof(fl2k_data_info_t));
+		data_info.ctx = dev->cb_ctx;
+		data_info.device_error = 1;
+		dev->cb(&data_info);
+	}
+
+	/* notify application that the last sample has been sent */
+	if (dev->drained && dev->cb) {
+		memset(&data_info, 0, sizeof(fl2k_data_info_t));
+		data_info.ctx = dev->cb_ctx;
+		data_info.drained = 1;
+		dev->cb(&data_info);
+	}
+
+	dev->async_status = next_status;
+
+	pthread_exit(NULL);
+}
+
+/* Buffer format conversion functions for R, G, B DACs
+ *
+ * The FL2000 expects 24 bit pixels, with the 32 bit halves of every
+ * 64 bit word swapped. Every 24 bytes of a transfer thus carry 8 samples
+ * of each DAC. The source channels are first converted to 8 bit lanes
+ * in chunks small enough to stay in the L1 cache, and then interleaved
+ * in a single pass over the transfer buffer.
+ */
+#define FL2K_CONV_CHUNK		4096
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define FL2K_HAVE_SSE
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#endif
+
+typedef struct fl2k_conv {
+	uint32_t dither[3][4];		/* xorshift state, one per channel */
+	uint8_t lane[3][FL2K_CONV_CHUNK];
+} fl2k_conv_t;
+
+typedef struct fl2k_src {
+	const char *buf;
+	int format;
+	uint32_t stride;		/* in samples, 3 for packed RGB */
+} fl2k_src_t;
+
+static const uint8_t fl2k_zero_lane[FL2K_CONV_CHUNK];
+
+static void fl2k_conv_init(fl2k_conv_t *conv)
+{
+	unsigned int c, k;
+
+	for (c = 0; c < 3; c++)
+		for (k = 0; k < 4; k++)
+			conv->dither[c][k] = 0x9e3779b9 * (c * 4 + k + 1);
+}
+
+static inline void fl2k_xorshift(uint32_t *s)
+{
+	unsigned int k;
+
+	for (k = 0; k < 4; k++) {
+		s[k] ^= s[k] << 13;
+		s[k] ^= s[k] >> 17;
+		s[k] ^= s[k] << 5;
+	}
+}
+
+static inline int16_t fl2k_sat16(int32_t v)
+{
+	return v > 32767 ? 32767 : (v < -32768 ? -32768 : v);
+}
+
+/* s16 -> s8 with rounding, optional TPDF dither of +-1 LSB */
+static void fl2k_s16_to_s8_c(int8_t *out, const int16_t *in, uint32_t n,
+			     uint32_t stride, uint32_t *dither)
+{
+	uint32_t i, h;
+	int16_t t;
+	int d = 0;
+
+	for (i = 0; i < n; i++) {
+		if (dither) {
+			if (!(i & 7))
+				fl2k_xorshift(dither);
+			h = (dither[(i & 7) >> 1] >> ((i & 1) * 16)) & 0xffff;
+			d = (int)(h & 0xff) - (int)(h >> 8);
+		}
+		t = fl2k_sat16(in[i * stride] + d);
+		t = fl2k_sat16(t + 128);
+		out[i] = t >> 8;
+	}
+}
+
+/* f32 -> s8, full scale maps to +-127, optional TPDF dither of +-1 LSB */
+static void fl2k_f32_to_s8_c(int8_t *out, const float *in, uint32_t n,
+			     uint32_t stride, uint32_t *dither)
+{
+	uint32_t i;
+	float v, d = 0.0f;
+
+	for (i = 0; i < n; i++) {
+		if (dither) {
+			if (!(i & 3))
+				fl2k_xorshift(dither);
+			d = (float)((int32_t)(dither[i & 3] & 0xffff) -
+				    (int32_t)(dither[i & 3] >> 16)) *
+			    (1.0f / 65536.0f);
+		}
+		v = in[i * stride] * 127.0f + d;
+		v = v < -128.0f ? -128.0f : (v > 127.0f ? 127.0f : v);
+		out[i] = (int8_t)lrintf(v);
+	}
+}
+
+static void fl2k_gather8(uint8_t *out, const uint8_t *in, uint32_t n,
+			 uint32_t stride)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++)
+		out[i] = in[i * stride];
+}
+
+static void fl2k_interleave_c(unsigned char *out, const uint8_t **lane,
+			      const uint8_t *offset, uint32_t n,
+			      unsigned int skip)
+{
+	const uint8_t *r = lane[0], *g = lane[1], *b = lane[2];
+	uint8_t ro = offset[0], go = offset[1], bo = offset[2];
+	uint32_t i, j;
+
+	for (i = 0, j = 0; j < n; i += 24, j += 8) {
+		if (!(skip & 1)) {
+			out[i+ 6] = r[j+0] + ro;
+			out[i+ 1] = r[j+1] + ro;
+			out[i+12] = r[j+2] + ro;
+			out[i+15] = r[j+3] + ro;
+			out[i+10] = r[j+4] + ro;
+			out[i+21] = r[j+5] + ro;
+			out[i+16] = r[j+6] + ro;
+			out[i+19] = r[j+7] + ro;
+		}
+
+		if (!(skip & 2)) {
+			out[i+ 5] = g[j+0] + go;
+			out[i+ 0] = g[j+1] + go;
+			out[i+ 3] = g[j+2] + go;
+			out[i+14] = g[j+3] + go;
+			out[i+ 9] = g[j+4] + go;
+			out[i+20] = g[j+5] + go;
+			out[i+23] = g[j+6] + go;
+			out[i+18] = g[j+7] + go;
+		}
+
+		if (!(skip & 4)) {
+			out[i+ 4] = b[j+0] + bo;
+			out[i+ 7] = b[j+1] + bo;
+			out[i+ 2] = b[j+2] + bo;
+			out[i+13] = b[j+3] + bo;
+			out[i+ 8] = b[j+4] + bo;
+			out[i+11] = b[j+5] + bo;
+			out[i+22] = b[j+6] + bo;
+			out[i+17] = b[j+7] + bo;
+		}
+	}
+}
+
+#ifdef FL2K_HAVE_SSE
+#define Z	-128
+
+/* pshufb masks placing 16 samples of one lane into 48 output bytes */
+static const int8_t fl2k_shuf[3][3][16] __attribute__((aligned(16))) = {
+	{ /* R */
+		{  Z,  1,  Z,  Z,  Z,  Z,  0,  Z,  Z,  Z,  4,  Z,  2,  Z,  Z,  3 },
+		{  6,  Z,  Z,  7,  Z,  5,  Z,  Z,  Z,  9,  Z,  Z,  Z,  Z,  8,  Z },
+		{  Z,  Z, 12,  Z, 10,  Z,  Z, 11, 14,  Z,  Z, 15,  Z, 13,  Z,  Z },
+	}, { /* G */
+		{  1,  Z,  Z,  2,  Z,  0,  Z,  Z,  Z,  4,  Z,  Z,  Z,  Z,  3,  Z },
+		{  Z,  Z,  7,  Z,  5,  Z,  Z,  6,  9,  Z,  Z, 10,  Z,  8,  Z,  Z },
+		{  Z, 12,  Z,  Z,  Z,  Z, 11,  Z,  Z,  Z, 15,  Z, 13,  Z,  Z, 14 },
+	}, { /* B */
+		{  Z,  Z,  2,  Z,  0,  Z,  Z,  1,  4,  Z,  Z,  5,  Z,  3,  Z,  Z },
+		{  Z,  7,  Z,  Z,  Z,  Z,  6,  Z,  Z,  Z, 10,  Z,  8,  Z,  Z,  9 },
+		{ 12,  Z,  Z, 13,  Z, 11,  Z,  Z,  Z, 15,  Z,  Z,  Z,  Z, 14,  Z },
+	},
+};
+
+#undef Z
+
+static int fl2k_have_ssse3(void)
+{
+	static int have = -1;
+
+	if (have < 0) {
+		__builtin_cpu_init();
+		have = __builtin_cpu_supports("ssse3") ? 1 : 0;
+	}
+
+	return have;
+}
+
+__attribute__((target("ssse3")))
+static void fl2k_interleave_ssse3(unsigned char *out, const uint8_t **lane,
+				  const uint8_t *offset, uint32_t n,
+				  unsigned int skip)
+{
+	__m128i m[3][3], off[3], v[3], keep[3], o;
+	uint32_t i, j, c;
+
+	for (j = 0; j < 3; j++)
+		keep[j] = _mm_setzero_si128();
+
+	for (c = 0; c < 3; c++) {
+		off[c] = _mm_set1_epi8((char)offset[c]);
+		for (j = 0; j < 3; j++) {
+			m[c][j] = _mm_load_si128((const __m128i *)fl2k_shuf[c][j]);
+
+			/* bytes of skipped lanes are kept as they are */
+			if (skip & (1 << c))
+				keep[j] = _mm_or_si128(keep[j],
+					_mm_cmpgt_epi8(m[c][j], _mm_set1_epi8(-1)));
+		}
+	}
+
+	for (i = 0; i + 16 <= n; i += 16, out += 48) {
+		for (c = 0; c < 3; c++)
+			v[c] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)
+							     (lane[c] + i)),
+					     off[c]);
+
+		for (j = 0; j < 3; j++) {
+			o = _mm_or_si128(_mm_shuffle_epi8(v[0], m[0][j]),
+					 _mm_shuffle_epi8(v[1], m[1][j]));
+			o = _mm_or_si128(o, _mm_shuffle_epi8(v[2], m[2][j]));
+
+			if (skip)
+				o = _mm_or_si128(_mm_andnot_si128(keep[j], o),
+						 _mm_and_si128(keep[j],
+						 _mm_loadu_si128((const __m128i *)
+								 (out + j * 16))));
+
+			_mm_storeu_si128((__m128i *)(out + j * 16), o);
+		}
+	}
+
+	if (i < n) {
+		const uint8_t *tail[3] = { lane[0] + i, lane[1] + i, lane[2] + i };
+		fl2k_interleave_c(out, tail, offset, n - i, skip);
+	}
+}
+
+static inline __m128i fl2k_xorshift_sse(__m128i x)
+{
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+	return _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+}
+
+static void fl2k_s16_to_s8_sse2(int8_t *out, const int16_t *in, uint32_t n,
+				uint32_t *dither)
+{
+	const __m128i lo = _mm_set1_epi16(0x00ff);
+	const __m128i half = _mm_set1_epi16(128);
+	__m128i s = dither ? _mm_loadu_si128((const __m128i *)dither) :
+			     _mm_setzero_si128();
+	__m128i a, b;
+	uint32_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		a = _mm_loadu_si128((const __m128i *)(in + i));
+		b = _mm_loadu_si128((const __m128i *)(in + i + 8));
+
+		if (dither) {
+			s = fl2k_xorshift_sse(s);
+			a = _mm_adds_epi16(a, _mm_sub_epi16(_mm_and_si128(s, lo),
+							    _mm_srli_epi16(s, 8)));
+			s = fl2k_xorshift_sse(s);
+			b = _mm_adds_epi16(b, _mm_sub_epi16(_mm_and_si128(s, lo),
+							    _mm_srli_epi16(s, 8)));
+		}
+
+		a = _mm_srai_epi16(_mm_adds_epi16(a, half), 8);
+		b = _mm_srai_epi16(_mm_adds_epi16(b, half), 8);
+		_mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi16(a, b));
+	}
+
+	if (dither)
+		_mm_storeu_si128((__m128i *)dither, s);
+
+	if (i < n)
+		fl2k_s16_to_s8_c(out + i, in + i, n - i, 1, dither);
+}
+
+static void fl2k_f32_to_s8_sse2(int8_t *out, const float *in, uint32_t n,
+				uint32_t *dither)
+{
+	const __m128i lo = _mm_set1_epi32(0xffff);
+	const __m128 scale = _mm_set1_ps(127.0f);
+	const __m128 dscale = _mm_set1_ps(1.0f / 65536.0f);
+	const __m128 vmin = _mm_set1_ps(-128.0f);
+	const __m128 vmax = _mm_set1_ps(127.0f);
+	__m128i s = dither ? _mm_loadu_si128((const __m128i *)dither) :
+			     _mm_setzero_si128();
+	__m128i q[4];
+	__m128 v;
+	uint32_t i, k;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		for (k = 0; k < 4; k++) {
+			v = _mm_mul_ps(_mm_loadu_ps(in + i + k * 4), scale);
+
+			if (dither) {
+				s = fl2k_xorshift_sse(s);
+				v = _mm_add_ps(v, _mm_mul_ps(_mm_cvtepi32_ps(
+					_mm_sub_epi32(_mm_and_si128(s, lo),
+						      _mm_srli_epi32(s, 16))),
+					dscale));
+			}
+
+			v = _mm_min_ps(_mm_max_ps(v, vmin), vmax);
+			q[k] = _mm_cvtps_epi32(v);
+		}
+
+		_mm_storeu_si128((__m128i *)(out + i),
+				 _mm_packs_epi16(_mm_packs_epi32(q[0], q[1]),
+						 _mm_packs_epi32(q[2], q[3])));
+	}
+
+	if (dither)
+		_mm_storeu_si128((__m128i *)dither, s);
+
+	if (i < n)
+		fl2k_f32_to_s8_c(out + i, in + i, n - i, 1, dither);
+}
+#endif
+
+/* Convert n samples of one channel, starting at sample pos, to an 8 bit
+ * lane. Returns the lane, which may point directly into the source. */
+static const uint8_t *fl2k_convert_lane(fl2k_conv_t *conv, unsigned int c,
+					const fl2k_src_t *src, uint32_t pos,
+					uint32_t n, int use_dither,
+					uint8_t *offset)
+{
+	uint32_t *dither = use_dither ? conv->dither[c] : NULL;
+	uint8_t *lane = conv->lane[c];
+
+	if (!src->buf) {
+		*offset = 0;
+		return fl2k_zero_lane;
+	}
+
+	switch (src->format) {
+	case FL2K_SAMPLE_S8:
+	case FL2K_SAMPLE_U8:
+		*offset = (src->format == FL2K_SAMPLE_S8) ? 128 : 0;
+		if (src->stride == 1)
+			return (const uint8_t *)src->buf + pos;
+
+		fl2k_gather8(lane, (const uint8_t *)src->buf + pos * src->stride,
+			     n, src->stride);
+		return lane;
+	case FL2K_SAMPLE_S16:
+		*offset = 128;
+#ifdef FL2K_HAVE_SSE
+		if (src->stride == 1) {
+			fl2k_s16_to_s8_sse2((int8_t *)lane,
+					    (const int16_t *)src->buf + pos, n,
+					    dither);
+			return lane;
+		}
+#endif
+		fl2k_s16_to_s8_c((int8_t *)lane,
+				 (const int16_t *)src->buf + pos * src->stride,
+				 n, src->stride, dither);
+		return lane;
+	case FL2K_SAMPLE_F32:
+		*offset = 128;
+#ifdef FL2K_HAVE_SSE
+		if (src->stride == 1) {
+			fl2k_f32_to_s8_sse2((int8_t *)lane,
+					    (const float *)src->buf + pos, n,
+					    dither);
+			return lane;
+		}
+#endif
+		fl2k_f32_to_s8_c((int8_t *)lane,
+				 (const float *)src->buf + pos * src->stride,
+				 n, src->stride, dither);
+		return lane;
+	default:
+		*offset = 0;
+		return fl2k_zero_lane;
+	}
+}
+
+static int fl2k_resolve_format(int format, int sampletype_signed)
+{
+	if (format == FL2K_SAMPLE_DEFAULT)
+		return sampletype_signed ? FL2K_SAMPLE_S8 : FL2K_SAMPLE_U8;
+
+	return format;
+}
+
+static uint32_t fl2k_format_size(int format)
+{
+	switch (format) {
+	case FL2K_SAMPLE_S16:
+		return 2;
+	case FL2K_SAMPLE_F32:
+		return 4;
+	default:
+		return 1;
+	}
+}
+
+/* Convert and interleave len samples of all channels into a transfer,
+ * leaving the lanes in the skip mask (bit 0: R, 1: G, 2: B) untouched */
+static void fl2k_convert(fl2k_conv_t *conv, unsigned char *out,
+			 fl2k_data_info_t *data_info, uint32_t len,
+			 unsigned int skip)
+{
+	fl2k_src_t src[3];
+	const uint8_t *lane[3];
+	uint8_t offset[3];
+	int sign[3] = { data_info->sampletype_signed_r,
+			data_info->sampletype_signed_g,
+			data_info->sampletype_signed_b };
+	uint32_t pos, n;
+	unsigned int c;
+
+	if (data_info->rgb_buf) {
+		for (c = 0; c < 3; c++) {
+			src[c].format = fl2k_resolve_format(data_info->rgb_format,
+							    sign[c]);
+			src[c].buf = (const char *)data_info->rgb_buf +
+				     c * fl2k_format_size(src[c].format);
+			src[c].stride = 3;
+		}
+	} else {
+		src[0].buf = data_info->r_buf;
+		src[1].buf = data_info->g_buf;
+		src[2].buf = data_info->b_buf;
+		src[0].format = fl2k_resolve_format(data_info->r_format, sign[0]);
+		src[1].format = fl2k_resolve_format(data_info->g_format, sign[1]);
+		src[2].format = fl2k_resolve_format(data_info->b_format, sign[2]);
+		for (c = 0; c < 3; c++)
+			src[c].stride = 1;
+	}
+
+	if (skip == 7)
+		return;
+
+	for (pos = 0; pos < len; pos += n) {
+		n = len - pos;
+		if (n > FL2K_CONV_CHUNK)
+			n = FL2K_CONV_CHUNK;
+
+		for (c = 0; c < 3; c++) {
+			if (skip & (1 << c)) {
+				lane[c] = fl2k_zero_lane;
+				offset[c] = 0;
+				continue;
+			}
+
+			lane[c] = fl2k_convert_lane(conv, c, &src[c], pos, n,
+						    data_info->dither,
+						    &offset[c]);
+		}
+
+#ifdef FL2K_HAVE_SSE
+		if (fl2k_have_ssse3())
+			fl2k_interleave_ssse3(out + pos * 3, lane, offset, n,
+					      skip);
+		else
+#endif
+			fl2k_interleave_c(out + pos * 3, lane, offset, n, skip);
+	}
+}
+
+/* When will a buffer filled now start to be output? Everything that is
+ * submitted or due before it goes out first, the oldest submitted
+ * transfer started when the last one completed. */
+static uint64_t fl2k_predict_emit(fl2k_dev_t *dev, uint64_t seq, uint64_t now)
+{
+	uint64_t buf_ns, start;
+	uint64_t depth;
+
+	if (dev->rate <= 0)
+		return now;
+
+	buf_ns = (uint64_t)(FL2K_BUF_LEN * 1e9 / dev->rate);
+
+	pthread_mutex_lock(&dev->buf_mutex);
+	depth = fl2k_count_xfers(dev, BUF_SUBMITTED);
+	if (seq > dev->submit_seq)
+		depth += seq - dev->submit_seq;
+	pthread_mutex_unlock(&dev->buf_mutex);
+
+	/* nothing completed yet, or the stream is stalled */
+	start = dev->stats.last_complete_ns;
+	if (!start || start + buf_ns < now)
+		start = now;
+
+	return start + depth * buf_ns;
+}
+
+/* Get an empty transfer and hand out the next sequence number with it.
+ * With several sample workers, transfers are claimed before calling back,
+ * so no more are handed out once draining. */
+static struct libusb_transfer *fl2k_claim_xfer(fl2k_dev_t *dev,
+					       unsigned int ring, int parallel)
+{
+	struct libusb_transfer *xfer = NULL;
+	fl2k_xfer_info_t *xfer_info;
+
+	pthread_mutex_lock(&dev->buf_mutex);
+
+	while (FL2K_RUNNING == dev->async_status &&
+	       !(parallel && dev->drain) &&
+	       !(xfer = fl2k_get_next_xfer(dev, BUF_EMPTY))) {
+		fl2k_trace(dev, ring, FL2K_TRACE_WAIT, 'B', dev->next_seq);
+		pthread_cond_wait(&dev->buf_cond, &dev->buf_mutex);
+		fl2k_trace(dev, ring, FL2K_TRACE_WAIT, 'E', dev->next_seq);
+	}
+
+	if (xfer && FL2K_RUNNING == dev->async_status &&
+	    !(parallel && dev->drain)) {
+		xfer_info = (fl2k_xfer_info_t *)xfer->user_data;
+		xfer_info->state = BUF_FILLING;
+		xfer_info->seq = dev->next_seq++;
+	} else {
+		xfer = NULL;
+	}
+
+	pthread_mutex_unlock(&dev->buf_mutex);
+
+	return xfer;
+}
+
+static void *fl2k_sample_worker(void *arg)
+{
+	fl2k_worker_t *worker = (fl2k_worker_t *)arg;
+	fl2k_dev_t *dev = worker->dev;
+	unsigned int ring = worker->ring;
+	int parallel = dev->worker_num > 1;
+	fl2k_xfer_info_t *xfer_info = NULL;
+	struct libusb_transfer *xfer = NULL;
+	char *out_buf = NULL;
+	fl2k_data_info_t data_info;
+	fl2k_conv_t conv;
+	uint32_t underflows = 0;
+	uint64_t seq;
+	uint64_t cb_start;
+	uint32_t gen[3];
+	unsigned int skip, c;
+
+	fl2k_conv_init(&conv);
+
+	while (FL2K_RUNNING == dev->async_status && !dev->drain) {
+		/* don't ask for samples while paused */
+		if (dev->paused) {
+			pthread_mutex_lock(&dev->buf_mutex);
+			while (dev->paused && FL2K_RUNNING == dev->async_status)
+				pthread_cond_wait(&dev->buf_cond, &dev->buf_mutex);
+			pthread_mutex_unlock(&dev->buf_mutex);
+
+			continue;
+		}
+
+		/* a single worker calls back before waiting for a transfer,
+		 * so the samples are ready as soon as one gets empty */
+		xfer = NULL;
+		if (parallel) {
+			xfer = fl2k_claim_xfer(dev, ring, parallel);
+			if (!xfer)
+				break;
+
+			seq = ((fl2k_xfer_info_t *)xfer->user_data)->seq;
+		} else {
+			seq = dev->next_seq;
+		}
+
+		memset(&data_info, 0, sizeof(fl2k_data_info_t));
+
+		data_info.len = FL2K_BUF_LEN;
+		data_info.underflow_cnt = dev->underflow_cnt;
+		data_info.ctx = dev->cb_ctx;
+
+		data_info.version = FL2K_DATA_INFO_VERSION;
+		data_info.seq = seq;
+		data_info.sample_index = seq * FL2K_BUF_LEN;
+		data_info.host_time_ns = fl2k_now_ns();
+		data_info.emit_time_ns = fl2k_predict_emit(dev, seq,
+						data_info.host_time_ns);
+
+		if (ring == FL2K_RING_SAMPLE &&
+		    dev->underflow_cnt > underflows) {
+			fprintf(stderr, "Underflow! Skipped %d buffers\n",
+					dev->underflow_cnt - underflows);
+			underflows = dev->underflow_cnt;
+		}
+
+		/* call application callback to get samples */
+		fl2k_trace(dev, ring, FL2K_TRACE_CALLBACK, 'B', seq);
+		cb_start = fl2k_now_ns();
+		if (dev->cb)
+			dev->cb(&data_info);
+		fl2k_stats_callback(dev, fl2k_now_ns() - cb_start);
+		fl2k_trace(dev, ring, FL2K_TRACE_CALLBACK, 'E', seq);
+
+		if (!xfer)
+			xfer = fl2k_claim_xfer(dev, ring, parallel);
+
+		/* in the meantime, the device might be gone */
+		if (!xfer)
+			break;
+
+		/* We have an empty USB transfer buffer */
+		xfer_info = (fl2k_xfer_info_t *)xfer->user_data;
+		out_buf = (char *)xfer->buffer;
+
+		/* lanes this transfer already holds don't need rewriting */
+		gen[0] = data_info.r_gen;
+		gen[1] = data_info.g_gen;
+		gen[2] = data_info.b_gen;
+
+		for (c = 0, skip = 0; c < 3; c++) {
+			if (gen[c] && gen[c] == xfer_info->gen[c])
+				skip |= 1 << c;
+
+			xfer_info->gen[c] = gen[c];
+		}
+
+		/* Re-arrange and copy bytes in buffer for DACs */
+		fl2k_trace(dev, ring, FL2K_TRACE_CONVERT, 'B', seq);
+		fl2k_convert(&conv, (unsigned char *)out_buf, &data_info,
+			     dev->xfer_buf_len / 3, skip);
+		fl2k_trace(dev, ring, FL2K_TRACE_CONVERT, 'E', seq);
+
+		if (dev->spectrum && dev->spectrum->want)
+			fl2k_spectrum_capture(dev->spectrum,
+					      (const uint8_t *)out_buf, seq);
+
+		xfer_info->state = BUF_FILLED;
+	}
+
+	/* the transfers handed out are all filled once the last worker
+	 * has stopped */
+	pthread_mutex_lock(&dev->buf_mutex);
+	if (!--dev->workers_running)
+		dev->drain_done = 1;
+	pthread_mutex_unlock(&dev->buf_mutex);
+
+	pthread_exit(NULL);
+}
+
+static int fl2k_start_workers(fl2k_dev_t *dev, fl2k_tx_cb_t cb, void *ctx,
+			      uint32_t buf_num, uint32_t workers)
+{
+	int r = 0;
+	uint32_t i;
+	pthread_attr_t attr;
+
+	if (!dev || !cb || !workers || workers > FL2K_MAX_PRODUCERS)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	dev->async_status = FL2K_RUNNING;
+	dev->async_cancel = 0;
+	dev->drain = 0;
+	dev->drain_done = 0;
+	dev->drained = 0;
+	dev->paused = 0;
+	dev->next_seq = 0;
+	dev->submit_seq = 0;
+
+	dev->cb = cb;
+	dev->cb_ctx = ctx;
+
+	if (buf_num > 0)
+		dev->xfer_num = buf_num;
+	else
+		dev->xfer_num = DEFAULT_BUF_NUMBER;
+
+	/* have spare buffers that can be filled while the others are
+	 * submitted, at least two, and one for every sample worker */
+	dev->xfer_buf_num = dev->xfer_num + workers + 1;
+	dev->xfer_buf_len = FL2K_XFER_LEN;
+
+	r = fl2k_alloc_transfers(dev);
+	if (r < 0)
+		goto cleanup;
+
+	dev->workers = calloc(workers, sizeof(fl2k_worker_t));
+	if (!dev->workers)
+		goto cleanup;
+
+	dev->worker_num = workers;
+	dev->workers_running = workers;
+
+	pthread_mutex_init(&dev->buf_mutex, NULL);
+	pthread_cond_init(&dev->buf_cond, NULL);
+	pthread_attr_init(&attr);
+
+	for (i = 0; i < workers; i++) {
+		dev->workers[i].dev = dev;
+		dev->workers[i].ring = FL2K_RING_SAMPLE + i;
+
+		r = pthread_create(&dev->workers[i].thread, &attr,
+				   fl2k_sample_worker, &dev->workers[i]);
+		if (r != 0) {
+			fprintf(stderr, "Error spawning sample worker thread!\n");
+			pthread_attr_destroy(&attr);
+			goto stop_workers;
+		}
+	}
+
+	if (dev->prefill_ms)
+		fl2k_prefill_transfers(dev);
+
+	fl2k_submit_transfers(dev);
+
+	r = pthread_create(&dev->usb_worker_thread, &attr,
+			   fl2k_usb_worker, (void *)dev);
+	pthread_attr_destroy(&attr);
+
+	if (r != 0) {
+		fprintf(stderr, "Error spawning USB worker thread!\n");
+		goto stop_workers;
+	}
+
+	return 0;
+
+stop_workers:
+	dev->async_status = FL2K_INACTIVE;
+	pthread_mutex_lock(&dev->buf_mutex);
+	pthread_cond_broadcast(&dev->buf_cond);
+	pthread_mutex_unlock(&dev->buf_mutex);
+	fl2k_join_workers(dev, i);
+
+cleanup:
+	dev->async_status = FL2K_INACTIVE;
+	free(dev->workers);
+	dev->workers = NULL;
+	_fl2k_free_async_buffers(dev);
+	return FL2K_ERROR_BUSY;
+}
+
+int fl2k_start_tx(fl2k_dev_t *dev, fl2k_tx_cb_t cb, void *ctx,
+		  uint32_t buf_num)
+{
+	return fl2k_start_workers(dev, cb, ctx, buf_num, 1);
+}
+
+int fl2k_start_tx_parallel(fl2k_dev_t *dev, fl2k_tx_cb_t cb, void *ctx,
+			   uint32_t buf_num, uint32_t threads)
+{
+	return fl2k_start_workers(dev, cb, ctx, buf_num, threads);
+}
+
+int fl2k_set_prefill(fl2k_dev_t *dev, uint32_t timeout_ms)
+{
+	if (!dev)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	if (FL2K_INACTIVE != dev->async_status)
+		return FL2K_ERROR_BUSY;
+
+	dev->prefill_ms = timeout_ms;
+
+	return 0;
+}
+
+int fl2k_set_low_watermark(fl2k_dev_t *dev, uint32_t level,
+			   fl2k_watermark_cb_t cb, void *ctx)
+{
+	if (!dev || (level && !cb))
+		return FL2K_ERROR_INVALID_PARAM;
+
+	pthread_mutex_lock(&dev->wm_mutex);
+	dev->wm_cb = cb;
+	dev->wm_ctx = ctx;
+	dev->wm_low = 0;
+	dev->wm_level = level;
+	pthread_mutex_unlock(&dev->wm_mutex);
+
+	return 0;
+}
+
+int fl2k_pause(fl2k_dev_t *dev)
+{
+	if (!dev)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	if (FL2K_RUNNING != dev->async_status)
+		return FL2K_ERROR_BUSY;
+
+	dev->paused = 1;
+
+	return 0;
+}
+
+int fl2k_resume(fl2k_dev_t *dev)
+{
+	if (!dev)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	if (FL2K_RUNNING != dev->async_status)
+		return FL2K_ERROR_BUSY;
+
+	pthread_mutex_lock(&dev->buf_mutex);
+	dev->paused = 0;
+	pthread_cond_broadcast(&dev->buf_cond);
+	pthread_mutex_unlock(&dev->buf_mutex);
+
+	return 0;
+}
+
+int fl2k_drain_tx(fl2k_dev_t *dev)
+{
+	if (!dev)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	if (FL2K_RUNNING != dev->async_status)
+		return FL2K_ERROR_BUSY;
+
+	dev->drain = 1;
+
+	return 0;
+}
+
+int fl2k_stop_tx(fl2k_dev_t *dev)
+{
+	if (!dev)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	/* if streaming, try to cancel gracefully */
+	if (FL2K_RUNNING == dev->async_status) {
+		dev->async_status = FL2K_CANCELING;
+		dev->async_cancel = 1;
+		return 0;
+	/* if called while in pending state, change the state forcefully */
+	} else if (FL2K_INACTIVE != dev->async_status) {
+		dev->async_status = FL2K_INACTIVE;
+		return 0;
+	}
+
+	return FL2K_ERROR_BUSY;
+}
+
+/* Start an I2C operation of 4 bytes and poll for its completion.
+ * The control transfers themselves take long enough, so polling back to
+ * back finishes a 4 byte operation within a few milliseconds, instead of
+ * waiting 10 ms per attempt. */
+static int fl2k_i2c_op(fl2k_dev_t *dev, uint32_t *reg, uint32_t cmd)
+{
+	uint64_t deadline;
+	int r;
+
+	/* apply mask, clearing bit 30 disables periodic repetition of read */
+	*reg = (*reg & 0x3ffc0000) | cmd;
+
+	r = fl2k_write_reg(dev, 0x8020, *reg);
+	if (r < 0)
+		return r;
+
+	deadline = fl2k_now_ns() + I2C_TIMEOUT * 1000000ULL;
+
+	do {
+		r = fl2k_read_reg(dev, 0x8020, reg);
+		if (r < 0)
+			return r;
+
+		/* check if operation completed */
+		if (*reg & (1 << 31)) {
+			/* check if slave responded and all data was transferred */
+			if (*reg & (0x0f << 24))
+				return FL2K_ERROR_NOT_FOUND;
+
+			return FL2K_SUCCESS;
+		}
+	} while (fl2k_now_ns() < deadline);
+
+	return FL2K_ERROR_TIMEOUT;
+}
+
+static int fl2k_i2c_read_4(fl2k_dev_t *dev, uint32_t *reg, uint8_t i2c_addr,
+			   uint8_t reg_addr, uint8_t *data)
+{
+	int r;
+
+	/* set I2C register and address, select I2C read (bit 7) */
+	r = fl2k_i2c_op(dev, reg, (1 << 28) | (reg_addr << 8) | (1 << 7) |
+				  (i2c_addr & 0x7f));
+	if (r < 0)
+		return r;
+
+	/* read data from register 0x8024 */
+	r = libusb_control_transfer(dev->devh, CTRL_IN, 0x40,
+				    0, 0x8024, data, 4, CTRL_TIMEOUT);
+
+	return r < 0 ? r : FL2K_SUCCESS;
+}
+
+static int fl2k_i2c_write_4(fl2k_dev_t *dev, uint32_t *reg, uint8_t i2c_addr,
+			    uint8_t reg_addr, const uint8_t *data)
+{
+	int r;
+
+	/* write data to register 0x8028 */
+	r = libusb_control_transfer(dev->devh, CTRL_OUT, 0x41,
+				    0, 0x8028, (uint8_t *)data, 4, CTRL_TIMEOUT);
+	if (r < 0)
+		return r;
+
+	/* set I2C register and address */
+	return fl2k_i2c_op(dev, reg, (1 << 28) | (reg_addr << 8) |
+				     (i2c_addr & 0x7f));
+}
+
+int fl2k_i2c_read(fl2k_dev_t *dev, uint8_t i2c_addr, uint8_t reg_addr, uint8_t *data)
+{
+	return fl2k_i2c_read_block(dev, i2c_addr, reg_addr, data, 4);
+}
+
+int fl2k_i2c_write(fl2k_dev_t *dev, uint8_t i2c_addr, uint8_t reg_addr, uint8_t *data)
+{
+	return fl2k_i2c_write_block(dev, i2c_addr, reg_addr, data, 4);
+}
+
+int fl2k_i2c_read_block(fl2k_dev_t *dev, uint8_t i2c_addr, uint8_t reg_addr,
+			uint8_t *data, uint32_t len)
+{
+	uint8_t tmp[4];
+	uint32_t reg, i;
+	int r;
+
+	/* the register address is 8 bit and every operation covers 4
+	 * registers, also the last one of a short tail: don't wrap to 0 */
+	if (!dev || (!data && len) ||
+	    (uint32_t)reg_addr + ((len + 3) & ~3U) > 0x100)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	pthread_mutex_lock(&dev->i2c_mutex);
+
+	r = fl2k_read_reg(dev, 0x8020, &reg);
+
+	for (i = 0; i < len && r >= 0; i += 4) {
+		if (len - i >= 4) {
+			r = fl2k_i2c_read_4(dev, &reg, i2c_addr,
+					    reg_addr + i, data + i);
+		} else {
+			r = fl2k_i2c_read_4(dev, &reg, i2c_addr,
+					    reg_addr + i, tmp);
+			memcpy(data + i, tmp, len - i);
+		}
+	}
+
+	pthread_mutex_unlock(&dev->i2c_mutex);
+
+	return r < 0 ? r : FL2K_SUCCESS;
+}
+
+int fl2k_i2c_write_block(fl2k_dev_t *dev, uint8_t i2c_addr, uint8_t reg_addr,
+			 const uint8_t *data, uint32_t len)
+{
+	uint8_t tmp[4];
+	uint32_t reg, i;
+	int r;
+
+	/* the register address is 8 bit and every operation covers 4
+	 * registers, also the last one of a short tail: don't wrap to 0 */
+	if (!dev || (!data && len) ||
+	    (uint32_t)reg_addr + ((len + 3) & ~3U) > 0x100)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	pthread_mutex_lock(&dev->i2c_mutex);
+
+	r = fl2k_read_reg(dev, 0x8020, &reg);
+
+	for (i = 0; i < len && r >= 0; i += 4) {
+		if (len - i >= 4) {
+			r = fl2k_i2c_write_4(dev, &reg, i2c_addr,
+					     reg_addr + i, data + i);
+		} else {
+			/* the FL2000 always writes 4 bytes, so write back
+			 * the current contents after the end of data */
+			r = fl2k_i2c_read_4(dev, &reg, i2c_addr,
+					    reg_addr + i, tmp);
+			if (r < 0)
+				break;
+
+			memcpy(tmp, data + i, len - i);
+			r = fl2k_i2c_write_4(dev, &reg, i2c_addr,
+					     reg_addr + i, tmp);
+		}
+	}
+
+	pthread_mutex_unlock(&dev->i2c_mutex);
+
+	return r < 0 ? r : FL2K_SUCCESS;
+}
+
+int fl2k_trace_enable(fl2k_dev_t *dev, uint32_t events, const char *path)
+{
+	fl2k_trace_t *trace;
+	unsigned int ring;
+	uint32_t size = 1;
+
+	if (!dev)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	/* rings can only be swapped while not streaming */
+	if (FL2K_INACTIVE != dev->async_status)
+		return FL2K_ERROR_BUSY;
+
+	fl2k_trace_free(dev->trace);
+	dev->trace = NULL;
+
+	if (!events)
+		return 0;
+
+	while (size < events)
+		size <<= 1;
+
+	trace = calloc(1, sizeof(fl2k_trace_t));
+	if (!trace)
+		return FL2K_ERROR_NO_MEM;
+
+	trace->events = size;
+	trace->t0 = fl2k_now_ns();
+
+	if (path)
+		trace->path = strdup(path);
+
+	for (ring = 0; ring < FL2K_TRACE_RINGS; ring++) {
+		trace->ring[ring].mask = size - 1;
+		trace->ring[ring].ev = calloc(size, sizeof(fl2k_trace_event_t));
+
+		if (!trace->ring[ring].ev) {
+			fl2k_trace_free(trace);
+			return FL2K_ERROR_NO_MEM;
+		}
+	}
+
+	dev->trace = trace;
+
+	return 0;
+}
+
+int fl2k_trace_dump(fl2k_dev_t *dev, const char *path)
+{
+	if (!dev || !dev->trace || !path)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	return fl2k_trace_write(dev->trace, path);
+}
+
+void fl2k_trace_request_dump(fl2k_dev_t *dev)
+{
+	if (dev && dev->trace)
+		dev->trace->dump_req = 1;
+}
+
+int fl2k_metrics_start(fl2k_dev_t *dev, const char *path, uint32_t interval_ms)
+{
+	fl2k_metrics_t *m;
+	int r;
+
+	if (!dev || !path)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	if (dev->metrics)
+		return FL2K_ERROR_BUSY;
+
+	m = calloc(1, sizeof(fl2k_metrics_t));
+	if (!m)
+		return FL2K_ERROR_NO_MEM;
+
+	m->interval_ms = interval_ms ? interval_ms : DEFAULT_METRICS_INTERVAL;
+
+	r = fl2k_publisher_open(&m->pub, path);
+	if (r < 0) {
+		free(m);
+		return r;
+	}
+
+	dev->metrics = m;
+
+	if (pthread_create(&m->thread, NULL, fl2k_metrics_worker, dev)) {
+		fl2k_publisher_close(&m->pub);
+		free(m);
+		dev->metrics = NULL;
+		return FL2K_ERROR_BUSY;
+	}
+
+	return 0;
+}
+
+int fl2k_metrics_stop(fl2k_dev_t *dev)
+{
+	if (!dev || !dev->metrics)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	dev->metrics->terminate = 1;
+	pthread_join(dev->metrics->thread, NULL);
+	fl2k_publisher_close(&dev->metrics->pub);
+	free(dev->metrics);
+	dev->metrics = NULL;
+
+	return 0;
+}
+
+int fl2k_spectrum_start(fl2k_dev_t *dev, const char *path, uint32_t fft_len,
+			uint32_t interval_ms)
+{
+	fl2k_spectrum_t *sp;
+	uint32_t i;
+	int r;
+
+	if (!dev || !path)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	if (!fft_len)
+		fft_len = DEFAULT_SPECTRUM_FFT_LEN;
+
+	if (fft_len < 64 || fft_len > 65536 || (fft_len & (fft_len - 1)))
+		return FL2K_ERROR_INVALID_PARAM;
+
+	if (dev->spectrum)
+		return FL2K_ERROR_BUSY;
+
+	sp = calloc(1, sizeof(fl2k_spectrum_t));
+	if (!sp)
+		return FL2K_ERROR_NO_MEM;
+
+	sp->fft_len = fft_len;
+	sp->interval_ms = interval_ms ? interval_ms : DEFAULT_METRICS_INTERVAL;
+	sp->out_size = 3 * (fft_len / 2 + 1) * 8 + 512;
+
+	sp->snap = malloc(fft_len * 3);
+	sp->window = malloc(fft_len * sizeof(float));
+	sp->re = malloc(fft_len * sizeof(float));
+	sp->im = malloc(fft_len * sizeof(float));
+	sp->out = malloc(sp->out_size);
+
+	if (!sp->snap || !sp->window || !sp->re || !sp->im || !sp->out) {
+		r = FL2K_ERROR_NO_MEM;
+		goto err;
+	}
+
+	/* Hann window */
+	for (i = 0; i < fft_len; i++)
+		sp->window[i] = 0.5f - 0.5f * cos(2.0 * M_PI * i / fft_len);
+
+	r = fl2k_publisher_open(&sp->pub, path);
+	if (r < 0)
+		goto err;
+
+	pthread_mutex_init(&sp->lock, NULL);
+	dev->spectrum = sp;
+
+	if (pthread_create(&sp->thread, NULL, fl2k_spectrum_worker, dev)) {
+		dev->spectrum = NULL;
+		pthread_mutex_destroy(&sp->lock);
+		fl2k_publisher_close(&sp->pub);
+		r = FL2K_ERROR_BUSY;
+		goto err;
+	}
+
+	return 0;
+
+err:
+	free(sp->snap);
+	free(sp->window);
+	free(sp->re);
+	free(sp->im);
+	free(sp->out);
+	free(sp);
+	return r;
+}
+
+int fl2k_spectrum_stop(fl2k_dev_t *dev)
+{
+	if (!dev || !dev->spectrum)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	/* the sample workers must not see it anymore */
+	if (FL2K_INACTIVE != dev->async_status)
+		return FL2K_ERROR_BUSY;
+
+	fl2k_spectrum_free(dev);
+
+	return 0;
+}
+
+/* Per-channel sample queues
+ *
+ * Every channel is fed by a queue of its own, so the producers of the
+ * three channels run independently and only meet when the callback takes
+ * one slot of each. A producer writes a slot in place and commits it,
+ * the callback hands the slots to the library and releases them on the
+ * next callback, after they have been converted.
+ */
+#define FL2K_QUEUE_MAX_SLOTS	64
+
+struct fl2k_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned char *mem;
+	uint32_t slots;
+	uint32_t slot_len;
+	int format;
+	uint64_t head;			/* slots committed by the producer */
+	uint64_t tail;			/* slots released by the consumer */
+	uint64_t underflows;		/* callbacks without a slot */
+	int holding;			/* consumer: slot at tail is in use */
+};
+
+static void fl2k_abs_timeout(struct timespec *ts, int timeout_ms)
+{
+#ifdef _WIN32
+	timespec_get(ts, TIME_UTC);
+#else
+	clock_gettime(CLOCK_REALTIME, ts);
+#endif
+	ts->tv_sec += timeout_ms / 1000;
+	ts->tv_nsec += (timeout_ms % 1000) * 1000000L;
+
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+/* wait on the queue with its lock held, returns 0 on timeout */
+static int fl2k_queue_wait(fl2k_queue_t *q, const struct timespec *deadline,
+			   int timeout_ms)
+{
+	if (timeout_ms < 0)
+		return !pthread_cond_wait(&q->cond, &q->lock);
+
+	if (!timeout_ms)
+		return 0;
+
+	return !pthread_cond_timedwait(&q->cond, &q->lock, deadline);
+}
+
+int fl2k_queue_create(fl2k_queue_t **out_q, uint32_t slots, int format)
+{
+	fl2k_queue_t *q;
+
+	if (!out_q || slots < 2 || slots > FL2K_QUEUE_MAX_SLOTS ||
+	    format <= FL2K_SAMPLE_DEFAULT || format > FL2K_SAMPLE_F32)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	q = calloc(1, sizeof(fl2k_queue_t));
+	if (!q)
+		return FL2K_ERROR_NO_MEM;
+
+	q->slots = slots;
+	q->format = format;
+	q->slot_len = FL2K_BUF_LEN * fl2k_format_size(format);
+
+	q->mem = malloc((size_t)slots * q->slot_len);
+	if (!q->mem) {
+		free(q);
+		return FL2K_ERROR_NO_MEM;
+	}
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+
+	*out_q = q;
+
+	return 0;
+}
+
+void *fl2k_queue_acquire(fl2k_queue_t *q, int timeout_ms)
+{
+	struct timespec deadline;
+	void *slot = NULL;
+
+	if (!q)
+		return NULL;
+
+	fl2k_abs_timeout(&deadline, timeout_ms > 0 ? timeout_ms : 0);
+
+	pthread_mutex_lock(&q->lock);
+
+	while (q->head - q->tail == q->slots) {
+		if (!fl2k_queue_wait(q, &deadline, timeout_ms))
+			break;
+	}
+
+	if (q->head - q->tail < q->slots)
+		slot = q->mem + (q->head % q->slots) * q->slot_len;
+
+	pthread_mutex_unlock(&q->lock);
+
+	return slot;
+}
+
+int fl2k_queue_commit(fl2k_queue_t *q)
+{
+	if (!q)
+		return FL2K_ERROR_INVALID_PARAM;
+
+	pthread_mutex_lock(&q->lock);
+	q->head++;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+
+	return 0;
+}
+
+int fl2k_queue_fill(fl2k_queue_t *r, fl2k_queue_t *g, fl2k_queue_t *b,
+		    fl2k_data_info_t *data_info, int timeout_ms)
+{
+	fl2k_queue_t *q[3] = { r, g, b };
+	struct timespec deadline;
+	unsigned char *slot;
+	unsigned int c;
+	int ready;
+
+	if (!data_info || (!r && !g && !b))
+		return FL2K_ERROR_INVALID_PARAM;
+
+	/* the slots of the previous callback have been converted */
+	for (c = 0; c < 3; c++) {
+		if (!q[c])
+			continue;
+
+		pthread_mutex_lock(&q[c]->lock);
+		if (q[c]->holding) {
+			q[c]->tail++;
+			q[c]->holding = 0;
+			pthread_cond_broadcast(&q[c]->cond);
+		}
+		pthread_mutex_unlock(&q[c]->lock);
+	}
+
+	fl2k_abs_timeout(&deadline, timeout_ms > 0 ? timeout_ms : 0);
+
+	/* only the consumer takes slots away, so a channel stays ready
+	 * while waiting for the others */
+	for (c = 0; c < 3; c++) {
+		if (!q[c])
+			continue;
 
-			if (dev->dev_lost || FL2K_INACTIVE == next_status) {
-				/* handle any events that still need to
-				 * be handled before exiting after we
-				 * just cancelled all transfers */
-				libusb_handle_events_timeout_completed(dev->ctx,
-								       &zerotv, NULL);
+		pthread_mutex_lock(&q[c]->lock);
+
+		while (q[c]->head == q[c]->tail) {
+			if (!fl2k_queue_wait(q[c], &deadline, timeout_ms))
 				break;
-			}
 		}
+
+		ready = q[c]->head != q[c]->tail;
+		if (!ready)
+			q[c]->underflows++;
+
+		pthread_mutex_unlock(&q[c]->lock);
+
+		/* leave all channels queued, so they stay aligned */
+		if (!ready)
+			return FL2K_ERROR_TIMEOUT;
 	}
 
-	/* wake up sample worker */
-	pthread_cond_signal(&dev->buf_cond);
+	for (c = 0; c < 3; c++) {
+		if (!q[c])
+			continue;
+
+		pthread_mutex_lock(&q[c]->lock);
+		q[c]->holding = 1;
+		slot = q[c]->mem + (q[c]->tail % q[c]->slots) * q[c]->slot_len;
+		pthread_mutex_unlock(&q[c]->lock);
 
-	/* wait for sample worker thread to finish before freeing buffers */
-	pthread_join(dev->sample_worker_thread, NULL);
-	_fl2k_free_async_buffers(dev);
-	dev->async_status = next_status;
+		switch (c) {
+		case 0:
+			data_info->r_buf = (char *)slot;
+			data_info->r_format = q[c]->format;
+			break;
+		case 1:
+			data_info->g_buf = (char *)slot;
+			data_info->g_format = q[c]->format;
+			break;
+		default:
+			data_info->b_buf = (char *)slot;
+			data_info->b_format = q[c]->format;
+			break;
+		}
+	}
 
-	pthread_exit(NULL);
+	return 0;
 }
 
-/* Buffer format conversion functions for R, G, B DACs */
-static inline void fl2k_convert_r(char *out,
-				  char *in,
-				  uint32_t len,
-				  uint8_t offset)
+int fl2k_queue_get_info(fl2k_queue_t *q, uint32_t *queued,
+			uint64_t *underflows)
 {
-	unsigned int i, j = 0;
+	if (!q)
+		return FL2K_ERROR_INVALID_PARAM;
 
-	if (!in || !out)
-		return;
+	pthread_mutex_lock(&q->lock);
 
-	for (i = 0; i < len; i += 24) {
-		out[i+ 6] = in[j++] + offset;
-		out[i+ 1] = in[j++] + offset;
-		out[i+12] = in[j++] + offset;
-		out[i+15] = in[j++] + offset;
-		out[i+10] = in[j++] + offset;
-		out[i+21] = in[j++] + offset;
-		out[i+16] = in[j++] + offset;
-		out[i+19] = in[j++] + offset;
-	}
+	if (queued)
+		*queued = q->head - q->tail;
+
+	if (underflows)
+		*underflows = q->underflows;
+
+	pthread_mutex_unlock(&q->lock);
+
+	return 0;
 }
 
-static inline void fl2k_convert_g(char *out,
-				  char *in,
-				  uint32_t len,
-				  uint8_t offset)
+void fl2k_queue_destroy(fl2k_queue_t *q)
 {
-	unsigned int i, j = 0;
-
-	if (!in || !out)
+	if (!q)
 		return;
 
-	for (i = 0; i < len; i += 24) {
-		out[i+ 5] = in[j++] + offset;
-		out[i+ 0] = in[j++] + offset;
-		out[i+ 3] = in[j++] + offset;
-		out[i+14] = in[j++] + offset;
-		out[i+ 9] = in[j++] + offset;
-		out[i+20] = in[j++] + offset;
-		out[i+23] = in[j++] + offset;
-		out[i+18] = in[j++] + offset;
-	}
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->cond);
+	free(q->mem);
+	free(q);
+}
+
+/* Shared memory ring, to feed the transmitter from other processes
+ *
+ * The ring lives in a memfd: a header page followed by the slots, each
+ * holding FL2K_BUF_LEN samples of all three channels, planar or packed.
+ * The transmitting process (consumer) listens on a Unix domain socket and
+ * passes the memfd and two eventfds to the producer connecting. The
+ * producer writes a slot in place and commits it, the consumer hands it
+ * to the library from the callback and releases it on the next callback,
+ * after it has been converted.
+ * head and the slot layouts are updated without atomic reservation, so
+ * there is only one producer at a time: the consumer keeps its connection
+ * open and turns away others until it is closed.
+ */
+#define FL2K_SHM_MAGIC		0x464c3253	/* "FL2S" */
+#define FL2K_SHM_BUSY		0x464c3242	/* "FL2B", another producer */
+#define FL2K_SHM_VERSION	1
+#define FL2K_SHM_MAX_SLOTS	64
+#define FL2K_SHM_HDR_LEN	4096
+
+typedef struct fl2k_shm_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t format;
+	uint64_t slot_len;
+	volatile uint64_t head;		/* slots committed by the producer */
+	volatile uint64_t tail;		/* slots released by the consumer */
+	volatile uint64_t underflows;	/* callbacks without a slot */
+	volatile uint32_t layout[FL2K_SHM_MAX_SLOTS];
+} fl2k_shm_hdr_t;
+
+struct fl2k_shm {
+	fl2k_shm_hdr_t *hdr;
+	size_t map_len;
+	int mem_fd;
+	int data_fd;			/* eventfd, signaled on commit */
+	int space_fd;			/* eventfd, signaled on release */
+	int sock_fd;			/* listening socket of the consumer */
+	int conn_fd;			/* connection to the producer */
+	char *path;
+	int holding;			/* consumer: slot at tail is in use */
+};
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC		0x0001U
+#endif
+
+static unsigned char *fl2k_shm_slot(fl2k_shm_t *shm, uint64_t idx)
+{
+	return (unsigned char *)shm->hdr + FL2K_SHM_HDR_LEN +
+	       (idx % shm->hdr->slots) * shm->hdr->slot_len;
 }
 
-static inline void fl2k_convert_b(char *out,
-				  char *in,
-				  uint32_t len,
-				  uint8_t offset)
+/* wait until an eventfd is signaled, and clear it */
+static int fl2k_shm_wait(int fd, int timeout_ms)
 {
-	unsigned int i, j = 0;
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	uint64_t val;
+	int r;
 
-	if (!in || !out)
-		return;
+	do {
+		r = poll(&pfd, 1, timeout_ms);
+	} while (r < 0 && errno == EINTR);
 
-	for (i = 0; i < len; i += 24) {
-		out[i+ 4] = in[j++] + offset;
-		out[i+ 7] = in[j++] + offset;
-		out[i+ 2] = in[j++] + offset;
-		out[i+13] = in[j++] + offset;
-		out[i+ 8] = in[j++] + offset;
-		out[i+11] = in[j++] + offset;
-		out[i+22] = in[j++] + offset;
-		out[i+17] = in[j++] + offset;
-	}
+	if (r <= 0)
+		return FL2K_ERROR_TIMEOUT;
+
+	if (read(fd, &val, sizeof(val)) < 0)
+		return FL2K_ERROR_TIMEOUT;
+
+	return 0;
 }
 
-static void *fl2k_sample_worker(void *arg)
+static void fl2k_shm_signal(int fd)
 {
-	int r = 0;
-	unsigned int i, j;
-	fl2k_dev_t *dev = (fl2k_dev_t *)arg;
-	fl2k_xfer_info_t *xfer_info = NULL;
-	struct libusb_transfer *xfer = NULL;
-	char *out_buf = NULL;
-	fl2k_data_info_t data_info;
-	uint32_t underflows = 0;
-	uint64_t buf_cnt = 0;
+	uint64_t val = 1;
 
-	while (FL2K_RUNNING == dev->async_status) {
-		memset(&data_info, 0, sizeof(fl2k_data_info_t));
+	if (write(fd, &val, sizeof(val)) < 0)
+		fprintf(stderr, "Failed to signal shared memory ring\n");
+}
 
-		data_info.len = FL2K_BUF_LEN;
-		data_info.underflow_cnt = dev->underflow_cnt;
-		data_info.ctx = dev->cb_ctx;
+/* the producer never sends anything, so readable means closed */
+static int fl2k_shm_peer_gone(int fd)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
 
-		if (dev->underflow_cnt > underflows) {
-			fprintf(stderr, "Underflow! Skipped %d buffers\n",
-					dev->underflow_cnt - underflows);
-			underflows = dev->underflow_cnt;
+	return poll(&pfd, 1, 0) != 0;
+}
+
+/* pass the file descriptors of the ring to a connecting producer */
+static void fl2k_shm_accept(fl2k_shm_t *shm)
+{
+	int fds[3] = { shm->mem_fd, shm->data_fd, shm->space_fd };
+	char ctrl[CMSG_SPACE(sizeof(fds))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	uint32_t magic;
+	int fd;
+
+	while ((fd = accept(shm->sock_fd, NULL, NULL)) >= 0) {
+		if (shm->conn_fd >= 0 && fl2k_shm_peer_gone(shm->conn_fd)) {
+			close(shm->conn_fd);
+			shm->conn_fd = -1;
 		}
 
-		/* call application callback to get samples */
-		if (dev->cb)
-			dev->cb(&data_info);
+		magic = (shm->conn_fd < 0) ? FL2K_SHM_MAGIC : FL2K_SHM_BUSY;
 
-		xfer = fl2k_get_next_xfer(dev, BUF_EMPTY);
+		memset(&msg, 0, sizeof(msg));
+		memset(ctrl, 0, sizeof(ctrl));
+		iov.iov_base = &magic;
+		iov.iov_len = sizeof(magic);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
 
-		if (!xfer) {
-			pthread_cond_wait(&dev->buf_cond, &dev->buf_mutex);
-			/* in the meantime, the device might be gone */
-			if (FL2K_RUNNING != dev->async_status)
-				break;
+		if (magic == FL2K_SHM_MAGIC) {
+			msg.msg_control = ctrl;
+			msg.msg_controllen = sizeof(ctrl);
 
-			xfer = fl2k_get_next_xfer(dev, BUF_EMPTY);
-			if (!xfer) {
-				fprintf(stderr, "no free transfer, skipping"
-						" input buffer\n");
-				continue;
-			}
+			cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+			memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
 		}
 
-		/* We have an empty USB transfer buffer */
-		xfer_info = (fl2k_xfer_info_t *)xfer->user_data;
-		out_buf = (char *)xfer->buffer;
+		if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+			fprintf(stderr, "Failed to pass shared memory ring\n");
+			close(fd);
+		} else if (magic == FL2K_SHM_MAGIC) {
+			shm->conn_fd = fd;
+		} else {
+			close(fd);
+		}
+	}
+}
 
-		/* Re-arrange and copy bytes in buffer for DACs */
-		fl2k_convert_r(out_buf, data_info.r_buf, dev->xfer_buf_len,
-			       data_info.sampletype_signed_r ? 128 : 0);
+static void fl2k_shm_free(fl2k_shm_t *shm)
+{
+	if (shm->hdr)
+		munmap(shm->hdr, shm->map_len);
 
-		fl2k_convert_g(out_buf, data_info.g_buf, dev->xfer_buf_len,
-			       data_info.sampletype_signed_g ? 128 : 0);
+	if (shm->mem_fd >= 0)
+		close(shm->mem_fd);
 
-		fl2k_convert_b(out_buf, data_info.b_buf, dev->xfer_buf_len,
-			       data_info.sampletype_signed_b ? 128 : 0);
+	if (shm->data_fd >= 0)
+		close(shm->data_fd);
 
-		xfer_info->seq = buf_cnt++;
-		xfer_info->state = BUF_FILLED;
-	}
+	if (shm->space_fd >= 0)
+		close(shm->space_fd);
 
-	/* notify application if we've lost the device */
-	if (dev->dev_lost && dev->cb) {
-		data_info.device_error = 1;
-		dev->cb(&data_info);
+	if (shm->conn_fd >= 0)
+		close(shm->conn_fd);
+
+	if (shm->sock_fd >= 0) {
+		close(shm->sock_fd);
+		unlink(shm->path);
 	}
 
-	pthread_exit(NULL);
+	free(shm->path);
+	free(shm);
 }
 
+static fl2k_shm_t *fl2k_shm_alloc(void)
+{
+	fl2k_shm_t *shm = calloc(1, sizeof(fl2k_shm_t));
+
+	if (shm) {
+		shm->mem_fd = -1;
+		shm->data_fd = -1;
+		shm->space_fd = -1;
+		shm->sock_fd = -1;
+		shm->conn_fd = -1;
+	}
 
-int fl2k_start_tx(fl2k_dev_t *dev, fl2k_tx_cb_t cb, void *ctx,
-		  uint32_t buf_num)
+	return shm;
+}
+
+int fl2k_shm_create(fl2k_shm_t **out_shm, const char *path, uint32_t slots,
+		    int format)
 {
-	int r = 0;
-	int i;
-	pthread_attr_t attr;
+	struct sockaddr_un addr;
+	fl2k_shm_t *shm;
+	uint64_t slot_len;
 
-	if (!dev || !cb)
+	if (!out_shm || !path || slots < 2 || slots > FL2K_SHM_MAX_SLOTS ||
+	    format <= FL2K_SAMPLE_DEFAULT || format > FL2K_SAMPLE_F32 ||
+	    strlen(path) >= sizeof(addr.sun_path))
 		return FL2K_ERROR_INVALID_PARAM;
 
-	dev->async_status = FL2K_RUNNING;
-	dev->async_cancel = 0;
+	shm = fl2k_shm_alloc();
+	if (!shm)
+		return FL2K_ERROR_NO_MEM;
 
-	dev->cb = cb;
-	dev->cb_ctx = ctx;
+	slot_len = (uint64_t)FL2K_BUF_LEN * 3 * fl2k_format_size(format);
+	shm->map_len = FL2K_SHM_HDR_LEN + slots * slot_len;
 
-	if (buf_num > 0)
-		dev->xfer_num = buf_num;
-	else
-		dev->xfer_num = DEFAULT_BUF_NUMBER;
+	shm->mem_fd = syscall(SYS_memfd_create, "fl2k-shm", MFD_CLOEXEC);
+	shm->data_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	shm->space_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (shm->mem_fd < 0 || shm->data_fd < 0 || shm->space_fd < 0 ||
+	    ftruncate(shm->mem_fd, shm->map_len) < 0)
+		goto err;
 
-	/* have two spare buffers that can be filled while the
-	 * others are submitted */
-	dev->xfer_buf_num = dev->xfer_num + 2;
-	dev->xfer_buf_len = FL2K_XFER_LEN;
+	shm->hdr = mmap(NULL, shm->map_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED, shm->mem_fd, 0);
+	if (shm->hdr == MAP_FAILED) {
+		shm->hdr = NULL;
+		goto err;
+	}
 
-	r = fl2k_alloc_submit_transfers(dev);
-	if (r < 0)
-		goto cleanup;
+	shm->hdr->magic = FL2K_SHM_MAGIC;
+	shm->hdr->version = FL2K_SHM_VERSION;
+	shm->hdr->slots = slots;
+	shm->hdr->format = format;
+	shm->hdr->slot_len = slot_len;
 
-	pthread_mutex_init(&dev->buf_mutex, NULL);
-	pthread_cond_init(&dev->buf_cond, NULL);
-	pthread_attr_init(&attr);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
 
-	r = pthread_create(&dev->usb_worker_thread, &attr,
-			   fl2k_usb_worker, (void *)dev);
-	if (r < 0) {
-		fprintf(stderr, "Error spawning USB worker thread!\n");
-		goto cleanup;
-	}
+	shm->path = strdup(path);
+	shm->sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC |
+				       SOCK_NONBLOCK, 0);
+	if (!shm->path || shm->sock_fd < 0)
+		goto err;
 
-	r = pthread_create(&dev->sample_worker_thread, &attr,
-			   fl2k_sample_worker, (void *)dev);
-	if (r < 0) {
-		fprintf(stderr, "Error spawning sample worker thread!\n");
-		goto cleanup;
+	unlink(path);
+	if (bind(shm->sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(shm->sock_fd, 4) < 0) {
+		fprintf(stderr, "Failed to listen on %s\n", path);
+		goto err;
 	}
 
-	pthread_attr_destroy(&attr);
+	*out_shm = shm;
 
 	return 0;
+err:
+	fl2k_shm_free(shm);
 
-cleanup:
-	_fl2k_free_async_buffers(dev);
-	return FL2K_ERROR_BUSY;
-
+	return FL2K_ERROR_NOT_FOUND;
 }
 
-int fl2k_stop_tx(fl2k_dev_t *dev)
+int fl2k_shm_fill(fl2k_shm_t *shm, fl2k_data_info_t *data_info,
+		  int timeout_ms)
 {
-	if (!dev)
+	fl2k_shm_hdr_t *hdr;
+	unsigned char *slot;
+	uint32_t plane;
+
+	if (!shm || shm->sock_fd < 0 || !data_info)
 		return FL2K_ERROR_INVALID_PARAM;
 
-	/* if streaming, try to cancel gracefully */
-	if (FL2K_RUNNING == dev->async_status) {
-		dev->async_status = FL2K_CANCELING;
-		dev->async_cancel = 1;
-		return 0;
-	/* if called while in pending state, change the state forcefully */
-	} else if (FL2K_INACTIVE != dev->async_status) {
-		dev->async_status = FL2K_INACTIVE;
-		return 0;
+	hdr = shm->hdr;
+	fl2k_shm_accept(shm);
+
+	/* the slot of the previous callback has been converted */
+	if (shm->holding) {
+		__sync_synchronize();
+		hdr->tail++;
+		shm->holding = 0;
+		fl2k_shm_signal(shm->space_fd);
 	}
 
-	return FL2K_ERROR_BUSY;
+	while (hdr->head == hdr->tail) {
+		if (fl2k_shm_wait(shm->data_fd, timeout_ms) < 0) {
+			hdr->underflows++;
+			return FL2K_ERROR_TIMEOUT;
+		}
+	}
+
+	__sync_synchronize();
+	slot = fl2k_shm_slot(shm, hdr->tail);
+
+	if (hdr->layout[hdr->tail % hdr->slots] == FL2K_SHM_PACKED) {
+		data_info->rgb_buf = slot;
+		data_info->rgb_format = hdr->format;
+	} else {
+		plane = FL2K_BUF_LEN * fl2k_format_size(hdr->format);
+		data_info->r_buf = (char *)slot;
+		data_info->g_buf = (char *)slot + plane;
+		data_info->b_buf = (char *)slot + 2 * plane;
+		data_info->r_format = hdr->format;
+		data_info->g_format = hdr->format;
+		data_info->b_format = hdr->format;
+	}
+
+	shm->holding = 1;
+
+	return 0;
 }
 
-int fl2k_i2c_read(fl2k_dev_t *dev, uint8_t i2c_addr, uint8_t reg_addr, uint8_t *data)
+int fl2k_shm_connect(fl2k_shm_t **out_shm, const char *path)
 {
-	int i, r, timeout = 1;
-	uint32_t reg;
-
-	if (!dev)
+	int fds[3] = { -1, -1, -1 };
+	char ctrl[CMSG_SPACE(sizeof(fds))];
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	struct stat st;
+	uint32_t magic = 0;
+	fl2k_shm_t *shm;
+	int fd;
+
+	if (!out_shm || !path || strlen(path) >= sizeof(addr.sun_path))
 		return FL2K_ERROR_INVALID_PARAM;
 
-	r = fl2k_read_reg(dev, 0x8020, &reg);
-	if (r < 0)
-		return r;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
 
-	/* apply mask, clearing bit 30 disables periodic repetition of read */
-	reg &= 0x3ffc0000;
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return FL2K_ERROR_NOT_FOUND;
 
-	/* set I2C register and address, select I2C read (bit 7) */
-	reg |= (1 << 28) | (reg_addr << 8) | (1 << 7) | (i2c_addr & 0x7f);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return FL2K_ERROR_NOT_FOUND;
+	}
 
-	r = fl2k_write_reg(dev, 0x8020, reg);
-	if (r < 0)
-		return r;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &magic;
+	iov.iov_len = sizeof(magic);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl;
+	msg.msg_controllen = sizeof(ctrl);
+
+	/* the consumer only accepts on its next callback */
+	if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) < (ssize_t)sizeof(magic) ||
+	    (magic != FL2K_SHM_MAGIC && magic != FL2K_SHM_BUSY)) {
+		close(fd);
+		return FL2K_ERROR_NOT_FOUND;
+	}
 
-	for (i = 0; i < 10; i++) {
-		sleep_ms(10);
+	if (magic == FL2K_SHM_BUSY) {
+		close(fd);
+		return FL2K_ERROR_BUSY;
+	}
 
-		r = fl2k_read_reg(dev, 0x8020, &reg);
-		if (r < 0)
-			return r;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+		close(fd);
+		return FL2K_ERROR_NOT_FOUND;
+	}
 
-		/* check if operation completed */
-		if (reg & (1 << 31)) {
-			timeout = 0;
-			break;
-		}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+	shm = fl2k_shm_alloc();
+	if (!shm) {
+		close(fds[0]);
+		close(fds[1]);
+		close(fds[2]);
+		close(fd);
+		return FL2K_ERROR_NO_MEM;
 	}
 
-	if (timeout)
-		return FL2K_ERROR_TIMEOUT;
+	shm->mem_fd = fds[0];
+	shm->data_fd = fds[1];
+	shm->space_fd = fds[2];
 
-	/* check if slave responded and all data was read */
-	if (reg & (0x0f << 24))
-		return FL2K_ERROR_NOT_FOUND;
+	/* held open until fl2k_shm_destroy(), the consumer turns away
+	 * other producers while it is */
+	shm->conn_fd = fd;
 
-	/* read data from register 0x8024 */
-	return libusb_control_transfer(dev->devh, CTRL_IN, 0x40,
-				       0, 0x8024, data, 4, CTRL_TIMEOUT);
+	if (fstat(shm->mem_fd, &st) < 0)
+		goto err;
+
+	shm->map_len = st.st_size;
+	shm->hdr = mmap(NULL, shm->map_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED, shm->mem_fd, 0);
+	if (shm->hdr == MAP_FAILED) {
+		shm->hdr = NULL;
+		goto err;
+	}
+
+	if (shm->hdr->magic != FL2K_SHM_MAGIC ||
+	    shm->hdr->version != FL2K_SHM_VERSION)
+		goto err;
+
+	*out_shm = shm;
+
+	return 0;
+err:
+	fl2k_shm_free(shm);
+
+	return FL2K_ERROR_NOT_FOUND;
 }
 
-int fl2k_i2c_write(fl2k_dev_t *dev, uint8_t i2c_addr, uint8_t reg_addr, uint8_t *data)
+void *fl2k_shm_acquire(fl2k_shm_t *shm, int timeout_ms)
 {
-	int i, r, timeout = 1;
-	uint32_t reg;
+	fl2k_shm_hdr_t *hdr;
 
-	if (!dev)
+	if (!shm || !shm->hdr)
+		return NULL;
+
+	hdr = shm->hdr;
+
+	/* backpressure: wait for the consumer to release a slot */
+	while (hdr->head - hdr->tail >= hdr->slots) {
+		if (fl2k_shm_wait(shm->space_fd, timeout_ms) < 0)
+			return NULL;
+	}
+
+	__sync_synchronize();
+
+	return fl2k_shm_slot(shm, hdr->head);
+}
+
+int fl2k_shm_commit(fl2k_shm_t *shm, int layout)
+{
+	fl2k_shm_hdr_t *hdr;
+
+	if (!shm || !shm->hdr)
 		return FL2K_ERROR_INVALID_PARAM;
 
-	/* write data to register 0x8028 */
-	r = libusb_control_transfer(dev->devh, CTRL_OUT, 0x41,
-				    0, 0x8028, data, 4, CTRL_TIMEOUT);
+	hdr = shm->hdr;
+	if (hdr->head - hdr->tail >= hdr->slots)
+		return FL2K_ERROR_BUSY;
 
-	if (r < 0)
-		return r;
+	hdr->layout[hdr->head % hdr->slots] = layout;
+	__sync_synchronize();
+	hdr->head++;
+	fl2k_shm_signal(shm->data_fd);
 
-	r = fl2k_read_reg(dev, 0x8020, &reg);
-	if (r < 0)
-		return r;
+	return 0;
+}
 
-	/* apply mask, clearing bit 30 disables periodic repetition of read */
-	reg &= 0x3ffc0000;
+int fl2k_shm_get_info(fl2k_shm_t *shm, int *format, uint32_t *slots,
+		      uint64_t *underflows)
+{
+	if (!shm || !shm->hdr)
+		return FL2K_ERROR_INVALID_PARAM;
 
-	/* set I2C register and address */
-	reg |= (1 << 28) | (reg_addr << 8) | (i2c_addr & 0x7f);
+	if (format)
+		*format = shm->hdr->format;
+	if (slots)
+		*slots = shm->hdr->slots;
+	if (underflows)
+		*underflows = shm->hdr->underflows;
 
-	r = fl2k_write_reg(dev, 0x8020, reg);
-	if (r < 0)
-		return r;
+	return 0;
+}
 
-	for (i = 0; i < 10; i++) {
-		sleep_ms(10);
+void fl2k_shm_destroy(fl2k_shm_t *shm)
+{
+	if (shm)
+		fl2k_shm_free(shm);
+}
+#else
+int fl2k_shm_create(fl2k_shm_t **out_shm, const char *path, uint32_t slots,
+		    int format)
+{
+	return FL2K_ERROR_NOT_SUPPORTED;
+}
 
-		r = fl2k_read_reg(dev, 0x8020, &reg);
-		if (r < 0)
-			return r;
+int fl2k_shm_fill(fl2k_shm_t *shm, fl2k_data_info_t *data_info,
+		  int timeout_ms)
+{
+	return FL2K_ERROR_NOT_SUPPORTED;
+}
 
-		/* check if operation completed */
-		if (reg & (1 << 31)) {
-			timeout = 0;
-			break;
-		}
-	}
+int fl2k_shm_connect(fl2k_shm_t **out_shm, const char *path)
+{
+	return FL2K_ERROR_NOT_SUPPORTED;
+}
 
-	if (timeout)
-		return FL2K_ERROR_TIMEOUT;
+void *fl2k_shm_acquire(fl2k_shm_t *shm, int timeout_ms)
+{
+	return NULL;
+}
 
-	/* check if slave responded and all data was written */
-	if (reg & (0x0f << 24))
-		return FL2K_ERROR_NOT_FOUND;
+int fl2k_shm_commit(fl2k_shm_t *shm, int layout)
+{
+	return FL2K_ERROR_NOT_SUPPORTED;
+}
+
+int fl2k_shm_get_info(fl2k_shm_t *shm, int *format, uint32_t *slots,
+		      uint64_t *underflows)
+{
+	return FL2K_ERROR_NOT_SUPPORTED;
+}
 
-	return FL2K_SUCCESS;
+void fl2k_shm_destroy(fl2k_shm_t *shm)
+{
 }
+#endif